@@ -1,294 +1,588 @@
-#include <list>
 #include <string>
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
-#include <sstream>
+#include <iterator>
 #include "arabic.h"
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define AASAAN_SSE2
+#endif
+
 namespace arabic {
 
 // Input functions
 
-inline
-void aasaan_either_or(std::istream& in, std::list<element_t>& out,
-                      token_t first, token_t second)
+// The parsers work on a contiguous buffer, using plain index
+// arithmetic for their lookahead.  Reading past the end of the
+// buffer yields a NUL, which matches nothing the parsers look for;
+// the few places that treat end of input specially test `pos' against
+// `len' directly.
+
+inline char aasaan_peek(const char * in, std::size_t len, std::size_t pos)
 {
-  char c;
-  in.get(c);
-  if (in.eof()) {
-    out.push_back(element_t(first, TF_CONSONANT));
-  } else {
-    switch (c) {
-    case 'h':
-      out.push_back(element_t(second, TF_CONSONANT));
-      break;
+  return pos < len ? in[pos] : '\0';
+}
 
-    default:
-      in.unget();
-    case '_':
-      out.push_back(element_t(first, TF_CONSONANT));
-      break;
+// Whitespace is what isspace accepts in the C locale: space, and tab
+// through carriage return.  Testing for it directly saves a call to
+// isspace per byte.
+
+inline bool aasaan_space(char c)
+{
+  return c == ' ' || (unsigned char) (c - '\t') <= '\r' - '\t';
+}
+
+static inline std::size_t aasaan_space_bytes(const char * in,
+                                             std::size_t len,
+                                             std::size_t pos, int& newlines)
+{
+  for (; pos < len && aasaan_space(in[pos]); pos++)
+    if (in[pos] == '\n')
+      newlines++;
+  return pos;
+}
+
+#ifdef AASAAN_SSE2
+
+// Classifies sixteen bytes at a time.  It is kept out of line, since
+// most runs end at their first byte and never get here.
+
+static std::size_t aasaan_space_blocks(const char * in, std::size_t len,
+                                       std::size_t pos, int& newlines)
+  __attribute__((noinline));
+
+static std::size_t aasaan_space_blocks(const char * in, std::size_t len,
+                                       std::size_t pos, int& newlines)
+{
+  const __m128i space	= _mm_set1_epi8(' ');
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i tab	= _mm_set1_epi8('\t');
+  const __m128i four	= _mm_set1_epi8(4);
+
+  while (pos + 16 <= len) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *) (in + pos));
+    __m128i ctl	  = _mm_sub_epi8(bytes, tab); // '\t' to '\r' become 0 to 4
+    __m128i white = _mm_or_si128(_mm_cmpeq_epi8(bytes, space),
+                                 _mm_cmpeq_epi8(_mm_min_epu8(ctl, four), ctl));
+
+    unsigned int mask  = _mm_movemask_epi8(white);
+    unsigned int lines = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+
+    if (mask != 0xffff) {
+      unsigned int run = __builtin_ctz(~mask);
+      newlines += __builtin_popcount(lines & ((1u << run) - 1));
+      return pos + run;
     }
+    newlines += __builtin_popcount(lines);
+    pos += 16;
   }
+  return aasaan_space_bytes(in, len, pos, newlines);
 }
 
-/* Turn a stream of Aasaan transliterated text into unambiguous
-   tokens, which can be used to render any form of output
-   encoding. */
+#endif // AASAAN_SSE2
 
-#ifdef MODE_STACK
-static std::list<mode_t> mode_stack;
-#endif
+// Return the end of the run of whitespace that starts at `pos', and
+// add the newlines in it to `newlines'.  A run of indentation can be
+// long, and with SSE2 it is scanned a block at a time.
 
-#define push(out, tok, flags) (out).push_back(element_t((tok), (flags)))
+static inline std::size_t aasaan_space_run(const char * in, std::size_t len,
+                                           std::size_t pos, int& newlines)
+{
+  if (pos == len || ! aasaan_space(in[pos]))
+    return pos;
+#ifdef AASAAN_SSE2
+  return aasaan_space_blocks(in, len, pos, newlines);
+#else
+  return aasaan_space_bytes(in, len, pos, newlines);
+#endif
+}
 
-bool parse_aasaan(std::istream& in, std::list<element_t>& out,
-                  mode_t mode, bool only_one = false)
+// Most units of Aasaan input stand for the same token wherever they
+// appear: a letter, a digraph like sh or .s, a prefix such as bi-, a
+// mark of punctuation.  They are listed here rather than spelled out
+// in parse_aasaan, which consults the table for any character its
+// switch does not handle, taking the longest unit that matches.  An
+// underscore after a letter that has a digraph form, as in s_h, keeps
+// the two apart.  A unit whose token is NONE is read and dropped.
+
+struct aasaan_unit_t {
+  const char *  text;
+  token_t	token;
+  unsigned long flags;
+};
+
+static const aasaan_unit_t aasaan_units[] = {
+  { "b",    BIH,	  TF_CONSONANT },
+  { "bi-",  PREFIX_BI,	  TF_NO_FLAGS },
+  { "p",    PIH,	  TF_CONSONANT },
+  { "t",    TIH,	  TF_CONSONANT },
+  { "t_",   TIH,	  TF_CONSONANT },
+  { "th",   THIH,	  TF_CONSONANT },
+  { "j",    JIIM,	  TF_CONSONANT },
+  { "c",    NONE,	  TF_NO_FLAGS },
+  { "ch",   CHIH,	  TF_CONSONANT },
+  { "H",    HIH,	  TF_CONSONANT },
+  { "k",    KAAF,	  TF_CONSONANT },
+  { "k_",   KAAF,	  TF_CONSONANT },
+  { "kh",   KHIH,	  TF_CONSONANT },
+  { "d",    DAAL,	  TF_CONSONANT },
+  { "d_",   DAAL,	  TF_CONSONANT },
+  { "dh",   DHAAL,	  TF_CONSONANT },
+  { "s",    SIIN,	  TF_CONSONANT },
+  { "s_",   SIIN,	  TF_CONSONANT },
+  { "sh",   SHIIN,	  TF_CONSONANT },
+  { "r",    RIH,	  TF_CONSONANT },
+  { "z",    ZIH,	  TF_CONSONANT },
+  { "z_",   ZIH,	  TF_CONSONANT },
+  { "zh",   ZHIH,	  TF_CONSONANT },
+  { "`",    AYN,	  TF_CONSONANT },
+  { "``",   LEFT_QUOTE,	  TF_NO_FLAGS },
+  { "g",    GAAF,	  TF_CONSONANT },
+  { "g_",   GAAF,	  TF_CONSONANT },
+  { "gh",   GHAYN,	  TF_CONSONANT },
+  { "f",    FIH,	  TF_CONSONANT },
+  { "q",    QAAF,	  TF_CONSONANT },
+  { "l",    LAAM,	  TF_CONSONANT },
+  { "li-",  PREFIX_LI,	  TF_NO_FLAGS },
+  { "m",    MIIM,	  TF_CONSONANT },
+  { "mii-", PREFIX_MII,	  TF_NO_FLAGS },
+  { "n",    NUUN,	  TF_CONSONANT },
+  { "v",    WAAW,	  TF_CONSONANT },
+  { "w",    WAAW,	  TF_CONSONANT },
+  { "wa-",  PREFIX_WA,	  TF_NO_FLAGS },
+  { "y",    YIH,	  TF_CONSONANT },
+  { ".h",   HIH_HUTII,	  TF_CONSONANT },
+  { ".s",   SAAD,	  TF_CONSONANT },
+  { ".d",   THAAD,	  TF_CONSONANT },
+  { ".t",   TAYN,	  TF_CONSONANT },
+  { ".z",   DTHAYN,	  TF_CONSONANT },
+  { "T",    TIH_MARBUTA,  TF_CONSONANT },
+  { "Y",    ALIF_MAQSURA, TF_VOWEL },
+  { "'",    HAMZA,	  TF_CONSONANT },
+  { "''",   RIGHT_QUOTE,  TF_NO_FLAGS },
+  { ".",    PERIOD,	  TF_NO_FLAGS },
+  { ",",    COMMA,	  TF_NO_FLAGS },
+  { ";",    SEMICOLON,	  TF_NO_FLAGS },
+  { ":",    COLON,	  TF_NO_FLAGS },
+  { "!",    EXCLAM,	  TF_NO_FLAGS },
+  { "?",    QUERY,	  TF_NO_FLAGS }
+};
+
+// The units above, compiled once into a DFA that reads one byte per
+// transition.  Each state stands for a prefix of some unit, and
+// accepts if that prefix is a whole unit; the start state, 0, is never
+// returned to, so a transition to it marks a byte no unit continues
+// with.  Bytes are first mapped to classes, one for each character
+// the units use and 0 for the rest, which keeps the table small enough
+// to stay in cache.  Most units are a single letter, whose state has
+// no way out, so the lexer stops there without reading on.
+
+class aasaan_lexer_t
 {
-  char c;
-  unsigned int start_size = out.size();
-  bool capitalize_next = false;
+  enum { STATES = 96, CLASSES = 48 };
+  enum { ACCEPTS = 1, CONTINUES = 2 };
+
+  unsigned char classes[256];
+  unsigned char next[STATES][CLASSES];
+  unsigned char kind[STATES];
+  element_t	elems[STATES];	// the unit a state accepts
+
+public:
+  aasaan_lexer_t() {
+    std::memset(next, 0, sizeof(next));
+    std::memset(kind, 0, sizeof(kind));
+    std::memset(classes, 0, sizeof(classes));
+
+    const unsigned int units = sizeof(aasaan_units) / sizeof(aasaan_units[0]);
+
+    unsigned int count = 1;
+    for (unsigned int i = 0; i < units; i++)
+      for (const char * p = aasaan_units[i].text; *p; p++)
+        if (! classes[(unsigned char) *p]) {
+          assert(count < CLASSES);
+          classes[(unsigned char) *p] = count++;
+        }
 
-  in.get(c);
-  while (! in.eof()) {
-    element_t& last = out.back();
+    unsigned int states = 1;
+    for (unsigned int i = 0; i < units; i++) {
+      unsigned int state = 0;
+      for (const char * p = aasaan_units[i].text; *p; p++) {
+        unsigned char& to(next[state][classes[(unsigned char) *p]]);
+        if (! to) {
+          assert(states < STATES);
+          to = states++;
+        }
+        kind[state] |= CONTINUES;
+        state = to;
+      }
+      kind[state] |= ACCEPTS;
+      elems[state] = element_t(aasaan_units[i].token, aasaan_units[i].flags);
+    }
+  }
 
-    switch (c) {
-    case 'a': {
-      bool parsed = false;
+  // Returns the longest unit at `pos', which must be before `len',
+  // and moves past it; or returns NULL and leaves `pos' alone
+  const element_t * match(const char * in, std::size_t len,
+                          std::size_t& pos) const {
+    const element_t * found = NULL;
+    unsigned int      state = 0;
+    std::size_t	      i	    = pos;
+
+    do {
+      state = next[state][classes[(unsigned char) in[i++]]];
+      if (! state)
+        break;
+      if (kind[state] & ACCEPTS) {
+        found = &elems[state];
+        pos   = i;
+      }
+    } while (kind[state] & CONTINUES && i < len);
 
-      in.get(c);
-      if (! in.eof()) {
-        switch (c) {
-        case 'a':
-          if (! is_letter(last))
-	    push(out, ALIF, TF_VOWEL | TF_BAA_KULAA);
-	  else
-	    push(out, ALIF, TF_VOWEL);
-          parsed = true;
-          break;
+    return found;
+  }
+};
 
-#if 0
-        case 'y':
-	  last.flags |= TF_FATHA;
-	  push(out, YIH, TF_CONSONANT | TF_DIPHTHONG);
-          parsed = true;
-          break;
+static const aasaan_lexer_t aasaan_lexer;
 
-        case 'w':
-	  last.flags |= TF_FATHA;
-	  push(out, WAAW, TF_CONSONANT | TF_DIPHTHONG);
-          parsed = true;
-          break;
-#endif
+// Word cache
 
-        case 'l':
-          if (! is_letter(last)) {
-            in.get(c);
-            if (! in.eof()) {
-              if (c == '-') {
-                parsed = true;
-                push(out, PREFIX_AL, TF_NO_FLAGS);
-                break;
-              }
-              in.unget();
-            }
-          }
-          // else fall through...
+static inline unsigned int word_hash(const char * word, std::size_t len,
+                                     mode_t mode, token_t prev)
+{
+  unsigned int hash = 2166136261u; // FNV-1a
+  for (std::size_t i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char) word[i]) * 16777619u;
+  hash = (hash ^ (mode << 8 | prev)) * 16777619u;
+  return hash ? hash : 1;
+}
 
-        default: {
-          in.unget();        // only parse the first 'a'
-          if (c == 'l')
-            break;
+void word_cache_t::set_capacity(std::size_t words)
+{
+  std::size_t size = 1;
+  while (size < words * 2)
+    size <<= 1;
+
+  capacity = words;
+  hits	   = 0;
+  misses   = 0;
+
+  std::vector<slot_t>().swap(slots);
+  std::string().swap(keys);
+  elements_t().swap(values);
+  if (words > 0) {
+    slot_t empty = { 0, 0, 0, 0, 0, 0, 0 };
+    slots.assign(size, empty);
+  }
+  entries = 0;
+}
 
-          // This rather complicated code allows for two
-          // different styles of specifying sun letters:
-          //
-          // Style 1: al-rra.hman
-          // Style 2: ar-ra.hman
-          //
-          // The first style is easy to parse, and is
-          // handled as AL + R/SHADDA ...; but the second
-          // requires foreward lookahead, which is done
-          // below.
-
-          std::streampos before = in.tellg();
-
-          if (is_letter(last) || last.token == SPACER ||
-              ! parse_aasaan(in, out, mode, true))
-            break;
-                    
-          element_t& prev = out.back();
-          element_t  copy = prev;
-
-          // If the parse below succeeds in finding another
-          // character, it means we did not see a doubled
-          // letter (TF_SHADDA).
-
-          in.get(c);
-          if (in.eof() || c != '-') {
-            out.pop_back();
-            in.seekg(before);
-            break;
-          }
+void word_cache_t::clear()
+{
+  slot_t empty = { 0, 0, 0, 0, 0, 0, 0 };
+  slots.assign(slots.size(), empty);
+  keys.clear();
+  values.clear();
+  entries = 0;
+}
 
-          if (parse_aasaan(in, out, mode, true)) {
-            out.pop_back();
-            out.pop_back();
-            in.seekg(before);
-            break;
-          }
+word_cache_t::stats_t word_cache_t::stats() const
+{
+  stats_t result;
+  result.hits	 = hits;
+  result.misses	 = misses;
+  result.entries = entries;
+  result.bytes	 = (slots.capacity() * sizeof(slot_t) + keys.capacity() +
+		    values.capacity() * sizeof(element_t));
+  return result;
+}
 
-          // We still have to check, since we might have
-          // ended the input at "ar-", in which case we
-          // would still get to this point.
+bool word_cache_t::lookup(const char * word, std::size_t len, mode_t mode,
+                          token_t prev, elements_t& out)
+{
+  unsigned int hash = word_hash(word, len, mode, prev);
+  std::size_t  mask = slots.size() - 1;
+
+  for (std::size_t i = hash & mask; slots[i].hash; i = (i + 1) & mask) {
+    const slot_t& slot(slots[i]);
+    if (slot.hash == hash && slot.key_len == len &&
+        slot.mode == mode && slot.prev == prev &&
+        std::memcmp(keys.data() + slot.key, word, len) == 0) {
+      elements_t::const_iterator first = values.begin() + slot.first;
+      out.insert(out.end(), first, first + slot.count);
+      hits++;
+      return true;
+    }
+  }
+  misses++;
+  return false;
+}
 
-          bool match = prev.flags & TF_SHADDA;
+void word_cache_t::insert(const char * word, std::size_t len, mode_t mode,
+                          token_t prev, elements_t::const_iterator begin,
+                          elements_t::const_iterator end)
+{
+  if (len > 0xff || end - begin > 0xff)
+    return;
+  if (entries == capacity)
+    clear();
+
+  unsigned int hash = word_hash(word, len, mode, prev);
+  std::size_t  mask = slots.size() - 1;
+  std::size_t  i    = hash & mask;
+  while (slots[i].hash)
+    i = (i + 1) & mask;
+
+  slot_t& slot(slots[i]);
+  slot.hash    = hash;
+  slot.key     = keys.length();
+  slot.first   = values.size();
+  slot.key_len = len;
+  slot.count   = end - begin;
+  slot.mode    = mode;
+  slot.prev    = prev;
+
+  keys.append(word, len);
+  values.insert(values.end(), begin, end);
+  entries++;
+}
 
-          out.pop_back();
+// A word is a run of non-space bytes.  Its parse depends on nothing
+// but its bytes, the mode and the token before it, with a few
+// exceptions: `^' and `~' may reach past either end of the word,
+// marking the token before it or the space after it; and `/' may
+// change the mode.  Return where the word at `start' ends if it may go
+// in the cache, or `start' if it may not.  Nor is a word that runs to
+// the end of the input cached, which keeps the parse of a missed word,
+// whose input is cut off at the word's end, from consulting the cache
+// in turn.
 
-          if (match) {
-            parsed = true;
-            push(out, PREFIX_AL, TF_SUN_LETTER);
-            copy.flags |= TF_SHADDA;
-            out.push_back(copy);
-          }
-          break;
-        }
-        }
-      }
+static const std::size_t max_cached_word = 64;
 
-      if (! parsed) {
-        if (is_letter(last))
-          last.flags |= TF_FATHA;
-        else
-          push(out, ALIF, TF_CONSONANT | TF_CARRIER | TF_FATHA);
-      }
-      break;
+static std::size_t cacheable_word(const char * in, std::size_t len,
+                                  std::size_t start)
+{
+  std::size_t end = start;
+  while (end < len && ! aasaan_space(in[end])) {
+    switch (in[end]) {
+    case '/':
+    case '^':
+    case '~':
+      return start;
     }
+    if (++end - start > max_cached_word)
+      return start;
+  }
 
-    case 'i': {
-      bool parsed = false;
+  if (end == start || end == len)
+    return start;
+  return end;
+}
 
-      in.get(c);
-      if (! in.eof()) {
-        switch (c) {
-        case 'i':
-          if (is_letter(last))
-            last.flags |= TF_KASRA;
-          else
-            push(out, ALIF, TF_CONSONANT | TF_CARRIER | TF_KASRA);
+// The flags of the hih an `h' at in[pos - 1] stands for, after `last'.
+// In Persian, a final hih with no long vowel or diphthong before it is
+// silent; see parse_aasaan.
 
-          parsed = true;
-          push(out, YIH, TF_VOWEL);
-          break;
+static inline unsigned long aasaan_hih_flags(const char * in,
+                                             std::size_t len,
+                                             std::size_t pos, mode_t mode,
+                                             const element_t& last)
+{
+  if (mode == PERSIAN &&
+      last.flags & TF_CONSONANT &&
+      ! (last.flags & TF_DIPHTHONG) &&
+      (pos == len || in[pos] == '-' || aasaan_space(in[pos])))
+    return TF_CONSONANT | TF_SILENT;
+  return TF_CONSONANT;
+}
 
-        default:
-          in.unget();        // only parse the first 'i'
-          break;
+// Read the letter that the unit at `pos' stands for after `last', and
+// move past it; or return NONE, leaving `pos' alone, if the unit is
+// not a letter of the unit table or `h'.
+
+static inline element_t aasaan_letter(const char * in, std::size_t len,
+                                      std::size_t& pos, mode_t mode,
+                                      const element_t& last)
+{
+  if (pos == len)
+    return element_t();
+
+  if (in[pos] == 'h') {
+    pos++;
+    return element_t(HIH, aasaan_hih_flags(in, len, pos, mode, last));
+  }
+
+  std::size_t	    end	 = pos;
+  const element_t * unit = aasaan_lexer.match(in, len, end);
+  if (! unit || ! is_letter(*unit))
+    return element_t();
+  pos = end;
+  return *unit;
+}
+
+/* Turn a stream of Aasaan transliterated text into unambiguous
+   tokens, which can be used to render any form of output
+   encoding. */
+
+#define push(out, tok, flags) (out).push_back(element_t((tok), (flags)))
+
+static bool parse_aasaan(context_t& ctx,
+                         const char * in, std::size_t len, std::size_t& pos,
+                         elements_t& out, mode_t& mode,
+                         bool only_one)
+{
+  unsigned int start_size = out.size();
+  bool capitalize_next = false;
+
+  // Stands in for the last token when nothing has been parsed yet
+  element_t none;
+
+  while (pos < len) {
+    char c = in[pos++];
+    std::size_t prior = out.size();
+    element_t * last = prior ? &out.back() : &none;
+
+    if (ctx.words.enabled() && (pos == 1 || aasaan_space(in[pos - 2])) &&
+        (last->token == NONE || last->token == SPACE ||
+         last->token == PARAGRAPH)) {
+      std::size_t start = pos - 1;
+      std::size_t end	= cacheable_word(in, len, start);
+
+      if (end != start) {
+        token_t prev = last->token;
+        if (! ctx.words.lookup(in + start, end - start, mode, prev, out)) {
+          pos = start;
+          parse_aasaan(ctx, in, end, pos, out, mode, false);
+          ctx.words.insert(in + start, end - start, mode, prev,
+                           out.begin() + prior, out.end());
         }
-      }
+        pos = end;
 
-      if (! parsed) {
-        if (is_letter(last))
-          last.flags |= TF_KASRA;
-        else
-          push(out, ALIF,
-               TF_CONSONANT | TF_CARRIER | TF_KASRA);
+        if (only_one)
+          break;
+        continue;
       }
-      break;
     }
 
-    case 'u': {
+    switch (c) {
+    case 'a': {
       bool parsed = false;
 
-      in.get(c);
-      if (! in.eof()) {
-        if (c == 'u' || c == 'w') {
+      switch (aasaan_peek(in, len, pos)) {
+      case 'a':
+        pos++;
+        if (! is_letter(*last))
+          push(out, ALIF, TF_VOWEL | TF_BAA_KULAA);
+        else
+          push(out, ALIF, TF_VOWEL);
+        parsed = true;
+        break;
+
+      case 'l':
+        if (! is_letter(*last) && aasaan_peek(in, len, pos + 1) == '-') {
+          pos += 2;
           parsed = true;
+          push(out, PREFIX_AL, TF_NO_FLAGS);
+        }
+        break;
 
-          if (is_letter(last))
-            last.flags |= TF_DHAMMA;
-          else
-            push(out, ALIF, TF_CONSONANT | TF_CARRIER | TF_DHAMMA);
+      case '\0':
+        if (pos == len)
+          break;
+        // fall through...
+
+      default: {
+        // This code allows for two different styles of
+        // specifying sun letters:
+        //
+        // Style 1: al-rra.hman
+        // Style 2: ar-ra.hman
+        //
+        // The first style is easy to parse, and is handled as
+        // AL + R/SHADDA ...; the second is a letter, a hyphen
+        // and the same letter again, which is matched here
+        // directly.  The letters are read as the parser would
+        // read them, so that t_-t is a match, but s-sh is not.
+
+        if (is_letter(*last) || last->token == SPACER)
+          break;
 
-          push(out, WAAW,
-               c == 'u' ? TF_VOWEL : TF_CONSONANT | TF_DIPHTHONG);
-        } else {
-          in.unget();        // only parse the first 'u'
-        }
+        std::size_t next   = pos;
+        element_t   letter = aasaan_letter(in, len, next, mode, *last);
+        if (letter.token == NONE || next == len || in[next] != '-')
+          break;
+        next++;
+        if (aasaan_letter(in, len, next, mode, letter) != letter)
+          break;
+
+        // Doubling the letter marks an al- before it, as it
+        // does for the first style
+        if (last->token == PREFIX_AL)
+          last->flags |= TF_SUN_LETTER;
+
+        push(out, PREFIX_AL, TF_SUN_LETTER);
+        letter.flags |= TF_SHADDA;
+        out.push_back(letter);
+        pos    = next;
+        parsed = true;
+        break;
+      }
       }
 
       if (! parsed) {
-        if (is_letter(last))
-          last.flags |= TF_DHAMMA;
+        if (is_letter(*last))
+          last->flags |= TF_FATHA;
         else
-          push(out, ALIF,
-               TF_CONSONANT | TF_CARRIER | TF_DHAMMA);
+          push(out, ALIF, TF_CONSONANT | TF_CARRIER | TF_FATHA);
       }
       break;
     }
 
-    case 'o':
-      if (is_letter(last))
-        last.flags |= TF_DHAMMA;
-      push(out, WAAW, TF_VOWEL | TF_SILENT);
-      break;
-
-    case 'e':
-      in.get(c);
-      if (! in.eof()) {
-        if (c == 'y') {
-          if (is_letter(last))
-            last.flags |= TF_KASRA;
-          else
-            push(out, ALIF, TF_CONSONANT | TF_CARRIER | TF_KASRA);
-          push(out, YIH, TF_CONSONANT | TF_DIPHTHONG);
-        } else {
-          in.unget();
-        }
-      }
-      break;
+    case 'i':
+      if (is_letter(*last))
+        last->flags |= TF_KASRA;
+      else
+        push(out, ALIF, TF_CONSONANT | TF_CARRIER | TF_KASRA);
 
-    case 'b':
-      in.get(c);
-      if (! in.eof()) {
-        if (c == 'i') {
-          in.get(c);
-          if (! in.eof()) {
-            if (c == '-') {
-              push(out, PREFIX_BI, TF_NO_FLAGS);
-              break;
-            }
-            in.unget();
-          }
-        }
-        in.unget();
+      if (aasaan_peek(in, len, pos) == 'i') {
+        pos++;
+        push(out, YIH, TF_VOWEL);
       }
-      push(out, BIH, TF_CONSONANT);
       break;
 
-    case 'p':
-      push(out, PIH, TF_CONSONANT);
-      break;
+    case 'u':
+      if (is_letter(*last))
+        last->flags |= TF_DHAMMA;
+      else
+        push(out, ALIF, TF_CONSONANT | TF_CARRIER | TF_DHAMMA);
 
-    case 't':
-      aasaan_either_or(in, out, TIH, THIH);
+      c = aasaan_peek(in, len, pos);
+      if (c == 'u' || c == 'w') {
+        pos++;
+        push(out, WAAW,
+             c == 'u' ? TF_VOWEL : TF_CONSONANT | TF_DIPHTHONG);
+      }
       break;
 
-    case 'j':
-      push(out, JIIM, TF_CONSONANT);
+    case 'o':
+      if (is_letter(*last))
+        last->flags |= TF_DHAMMA;
+      push(out, WAAW, TF_VOWEL | TF_SILENT);
       break;
 
-    case 'c':
-      in.get(c);
-      if (! in.eof()) {
-        if (c == 'h') {
-          push(out, CHIH, TF_CONSONANT);
-          break;
-        }
-        in.unget();
+    case 'e':
+      if (aasaan_peek(in, len, pos) == 'y') {
+        pos++;
+        if (is_letter(*last))
+          last->flags |= TF_KASRA;
+        else
+          push(out, ALIF, TF_CONSONANT | TF_CARRIER | TF_KASRA);
+        push(out, YIH, TF_CONSONANT | TF_DIPHTHONG);
       }
       break;
 
@@ -304,726 +598,1324 @@ bool parse_aasaan(std::istream& in, std::list<element_t>& out,
       // possession articles.  In cases where silent heh would
       // be chosen, use H to force non-silent heh.
 
-      unsigned long flags = TF_CONSONANT;
-
-      in.get(c);
-
-      if (mode == PERSIAN &&
-          last.flags & TF_CONSONANT &&
-          ! (last.flags & TF_DIPHTHONG) &&
-          (in.eof() || c == '-' || isspace(c))) {
-        flags |= TF_SILENT;
-      }
-      in.unget();
-
-      push(out, HIH, flags);
+      push(out, HIH, aasaan_hih_flags(in, len, pos, mode, *last));
       break;
     }
 
-    case 'H':
-      push(out, HIH, TF_CONSONANT);
-      break;
-
-    case 'k':
-      aasaan_either_or(in, out, KAAF, KHIH);
-      break;
-
-    case 'd':
-      aasaan_either_or(in, out, DAAL, DHAAL);
+    case 'N':
+      if (is_letter(*last))
+        last->flags |= TF_TANWEEN;
       break;
 
-    case 's':
-      aasaan_either_or(in, out, SIIN, SHIIN);
+#ifdef MODE_STACK
+    case 'A':
+      if (aasaan_peek(in, len, pos) == '/') {
+        pos++;
+        ctx.parse_modes.push_back(mode = ARABIC);
+        push(out, PUSH_MODE, mode);
+      }
       break;
+#endif // MODE_STACK
 
-    case 'r':
-      push(out, RIH, TF_CONSONANT);
+    case 'U':
+      if (aasaan_peek(in, len, pos) == 'A') {
+        // UA must occur at the end of a word (this is
+        // not enforced, however), and produces a vowel
+        // waaw with a final silent alif
+
+        pos++;
+        assert(is_letter(*last));
+        last->flags |= TF_DHAMMA;
+        push(out, WAAW, TF_VOWEL | TF_SILENT_ALIF);
+      }
       break;
 
-    case 'z':
-      aasaan_either_or(in, out, ZIH, ZHIH);
+#ifdef MODE_STACK
+    case 'P':
+      if (aasaan_peek(in, len, pos) == '/') {
+        pos++;
+        ctx.parse_modes.push_back(mode = PERSIAN);
+        push(out, PUSH_MODE, mode);
+      }
       break;
 
-    case '`':
-      in.get(c);
-      if (! in.eof()) {
-        if (c == '`') {
-          push(out, LEFT_QUOTE, TF_NO_FLAGS);
-          break;
+    case '/':
+      c = aasaan_peek(in, len, pos);
+      if (c == 'A' || c == 'P') {
+        pos++;
+        if (! ctx.parse_modes.empty()) {
+          mode = ctx.parse_modes.back();
+          ctx.parse_modes.pop_back();
         }
-        in.unget();
+        push(out, POP_MODE, mode);
+      } else {
+        push(out, UNKNOWN, (unsigned long) '/');
       }
-      push(out, AYN, TF_CONSONANT);
       break;
+#endif // MODE_STACK
 
-    case 'g':
-      aasaan_either_or(in, out, GAAF, GHAYN);
-      break;
+    case '^':
+      capitalize_next = true;
+      continue;
 
-    case 'f':
-      push(out, FIH, TF_CONSONANT);
+    case '~': {
+      mode_t inner = mode;
+      parse_aasaan(ctx, in, len, pos, out, inner, true);
+      if (! out.empty() && ! is_mode_change(out.back()))
+        out.back().flags |= TF_SHADDA;
       break;
+    }
 
-    case 'q':
-      push(out, QAAF, TF_CONSONANT);
+    case '_':
+      if (aasaan_peek(in, len, pos) == 'a') {
+        pos++;
+        if (is_letter(*last))
+          last->flags |= TF_DEFECTIVE_ALIF;
+      }
       break;
 
-    case 'l':
-      in.get(c);
-      if (! in.eof()) {
-        if (c == 'i') {
-          in.get(c);
-          if (! in.eof()) {
-            if (c == '-') {
-              push(out, PREFIX_LI, TF_NO_FLAGS);
-              break;
-            }
-            in.unget();
-          }
+    case '-':
+      // A hyphen directly after a letter may introduce the
+      // izaafih, or one of the enclitic suffixes; these must be
+      // followed by whitespace or the end of input.  Anything
+      // else is a harmless spacer.
+
+      if (is_letter(*last)) {
+        std::size_t end = pos;
+        while (end < len && end - pos < 4 && ! aasaan_space(in[end]))
+          end++;
+
+        if (end - pos == 1 && in[pos] == 'i') {
+          pos = end;
+          last->flags |= TF_IZAAFIH;
+          break;
         }
-        in.unget();
-      }
-      push(out, LAAM, TF_CONSONANT);
-      break;
-
-    case 'm':
-      in.get(c);
-      if (! in.eof()) {
-        if (c == 'i') {
-          in.get(c);
-          if (! in.eof()) {
-            if (c == 'i') {
-              in.get(c);
-              if (! in.eof()) {
-                if (c == '-') {
-                  push(out, PREFIX_MII, TF_NO_FLAGS);
-                  break;
-                }
-                in.unget();
-              }
-            }
-            in.unget();
-          }
+        else if (end - pos == 2 && in[pos] == 'i' && in[pos + 1] == 'i') {
+          pos = end;
+          push(out, SUFFIX_II, TF_NO_FLAGS);
+          break;
         }
-        in.unget();
-      }
-      push(out, MIIM, TF_CONSONANT);
-      break;
-
-    case 'n':
-      push(out, NUUN, TF_CONSONANT);
-      break;
-
-    case 'w':
-      in.get(c);
-      if (! in.eof()) {
-        if (c == 'a') {
-          in.get(c);
-          if (! in.eof()) {
-            if (c == '-') {
-              push(out, PREFIX_WA, TF_NO_FLAGS);
-              break;
-            }
-            in.unget();
-          }
+        else if (end - pos == 3 && (in[pos] == 'r' || in[pos] == 'h') &&
+                 in[pos + 1] == 'a' && in[pos + 2] == 'a') {
+          push(out, in[pos] == 'r' ? SUFFIX_RAA : SUFFIX_HAA,
+               TF_NO_FLAGS);
+          pos = end;
+          break;
         }
-        in.unget();
       }
-      // fall through...
-    case 'v':
-      push(out, WAAW, TF_CONSONANT);
+      push(out, SPACER, TF_NO_FLAGS);
       break;
 
-    case 'y':
-      push(out, YIH, TF_CONSONANT);
+    default: {
+      const element_t * unit = aasaan_lexer.match(in, len, --pos);
+      if (! unit)
+        push(out, UNKNOWN, (unsigned char) in[pos++]);
+      else if (unit->token != NONE)
+        out.push_back(*unit);
       break;
+    }
 
-    case '.':
-      in.get(c);
-      if (! in.eof()) {
-        switch (c) {
-        case 'h':
-          push(out, HIH_HUTII, TF_CONSONANT);
-          break;
+    case '\t':
+    case ' ':
+    case '\n': {
+      // Gobble up multiple whitespace characters; they
+      // collapse into SPACE, unless there are two returns,
+      // in which case it is a paragraph separator
 
-        case 's':
-          push(out, SAAD, TF_CONSONANT);
-          break;
+      int ret = 0;
+      pos = aasaan_space_run(in, len, pos, ret);
 
-        case 'd':
-          push(out, THAAD, TF_CONSONANT);
-          break;
+      if (ret > 1)
+        push(out, PARAGRAPH, TF_NO_FLAGS);
+      else
+        push(out, SPACE, TF_NO_FLAGS);
+      break;
+    }
+    }
 
-        case 't':
-          push(out, TAYN, TF_CONSONANT);
-          break;
+    if (prior)
+      last = &out[prior - 1];
 
-        case 'z':
-          push(out, DTHAYN, TF_CONSONANT);
-          break;
+    if (last != &none && ! (last->flags & TF_SHADDA) && is_sukun(*last) &&
+        prior != out.size() && *last == out.back() &&
+        ! is_mode_change(*last))
+      {
+        last->flags |= TF_SHADDA;
+        out.pop_back();
 
-        default:
-          in.unget();
-          push(out, PERIOD, TF_NO_FLAGS);
-          break;
+        // Check if this is a sun letter
+        if (out.size() > 1) {
+          element_t& before = out[out.size() - 2];
+          if (before.token == PREFIX_AL)
+            before.flags |= TF_SUN_LETTER;
         }
       }
-      break;
 
-    case 'N':
-      if (is_letter(last))
-        last.flags |= TF_TANWEEN;
-      break;
+    // A change of mode passes the capital on to the token after it
+    if (capitalize_next && ! out.empty() && ! is_mode_change(out.back())) {
+      out.back().flags |= TF_CAPITALIZE;
+      capitalize_next = false;
+    }
 
-    case 'T':
-      push(out, TIH_MARBUTA, TF_CONSONANT);
+    if (only_one && ! capitalize_next)
       break;
+  }
 
-    case 'Y':
-      push(out, ALIF_MAQSURA, TF_VOWEL);
-      break;
+  return start_size != out.size();
+}
 
-    case '\'':
-      in.get(c);
-      if (! in.eof()) {
-        if (c == '\'') {
-          push(out, RIGHT_QUOTE, TF_NO_FLAGS);
-          break;
-        }
-        in.unget();
-      }
-      push(out, HAMZA, TF_CONSONANT);
-      break;
+bool parse_aasaan(context_t& ctx, const char * in, std::size_t len,
+                  elements_t& out, mode_t mode,
+                  bool only_one = false)
+{
+  std::size_t pos = 0;
+  return parse_aasaan(ctx, in, len, pos, out, mode, only_one);
+}
 
-#ifdef MODE_STACK
-    case 'A':
-      in.get(c);
-      if (! in.eof()) {
-        if (c == '/') {
-          mode_stack.push_back(mode = ARABIC);
-          push(out, PUSH_MODE, mode);
-          break;
-        }
-        in.unget();
-      }
-      break;
-#endif // MODE_STACK
+bool parse_aasaan(context_t& ctx, std::istream& in, elements_t& out,
+                  mode_t mode, bool only_one = false)
+{
+  std::streampos start = in.tellg();
+  std::string&   buf(ctx.buffer);
 
-    case 'U':
-      in.get(c);
-      if (! in.eof()) {
-        if (c == 'A') {
-          // UA must occur at the end of a word (this is
-          // not enforced, however), and produces a vowel
-          // waaw with a final silent alif
-
-          assert(is_letter(last));
-          last.flags |= TF_DHAMMA;
-          push(out, WAAW, TF_VOWEL | TF_SILENT_ALIF);
-          break;
-        }
-        in.unget();
-      }
-      break;
-
-#ifdef MODE_STACK
-    case 'P':
-      in.get(c);
-      if (! in.eof()) {
-        if (c == '/') {
-          mode_stack.push_back(mode = PERSIAN);
-          push(out, PUSH_MODE, mode);
-          break;
-        }
-        in.unget();
-      }
-      break;
-
-    case '/':
-      in.get(c);
-      if (! in.eof()) {
-        if (c == 'A' || c == 'P') {
-          if (! mode_stack.empty()) {
-            mode = mode_stack.back();
-            mode_stack.pop_back();
-          }
-          push(out, POP_MODE, mode);
-        } else {
-          in.unget();
-	  push(out, UNKNOWN, (unsigned long) '/');
-        }
-      }
-      break;
-#endif // MODE_STACK
+  buf.assign(std::istreambuf_iterator<char>(in),
+             std::istreambuf_iterator<char>());
 
-    case '^':
-      capitalize_next = true;
-      goto NEXT;
-
-    case ',':
-      push(out, COMMA, TF_NO_FLAGS);
-      break;
+  std::size_t pos = 0;
+  bool result = parse_aasaan(ctx, buf.data(), buf.length(), pos, out, mode,
+                             only_one);
 
-    case ';':
-      push(out, SEMICOLON, TF_NO_FLAGS);
-      break;
-
-    case ':':
-      push(out, COLON, TF_NO_FLAGS);
-      break;
+  // Leave whatever was not consumed for the next caller
+  if (pos < buf.length() && start != std::streampos(-1)) {
+    in.clear();
+    in.seekg(start + std::streamoff(pos));
+  }
+  return result;
+}
 
-    case '!':
-      push(out, EXCLAM, TF_NO_FLAGS);
-      break;
+// Return the end of the last run of whitespace in `in' that a parse
+// may stop at, looking no further back than `from', or 0 if there is
+// none.  A run only counts once the text after it has been seen.
 
-    case '?':
-      push(out, QUERY, TF_NO_FLAGS);
-      break;
+static std::size_t aasaan_break(const char * in, std::size_t len,
+                                std::size_t from)
+{
+  if (len == 0)
+    return 0;
+
+  for (std::size_t pos = len - 1; pos >= from && pos > 0; pos--) {
+    if (aasaan_space(in[pos]) || ! aasaan_space(in[pos - 1]))
+      continue;
+
+    std::size_t start = pos - 1;
+    while (start > 0 && aasaan_space(in[start - 1]))
+      start--;
+    if (start == 0 || (in[start - 1] != '^' && in[start - 1] != '~'))
+      return pos;
+    pos = start;
+  }
+  return 0;
+}
 
-    case '~':
-      parse_aasaan(in, out, mode, true);
-      out.back().flags |= TF_SHADDA;
-      break;
+void aasaan_parser_t::feed(const char * data, std::size_t len,
+                           elements_t& out)
+{
+  std::size_t from = held.length();
+  held.append(data, len);
 
-    case '_':
-      in.get(c);
-      if (! in.eof()) {
-        if (c == 'a') {
-          if (is_letter(last))
-            last.flags |= TF_DEFECTIVE_ALIF;
-        } else {
-          in.unget();
-        }
-      }
-      break;
+  std::size_t end = aasaan_break(held.data(), held.length(), from);
+  if (end > 0) {
+    parse(end, true, out);
+    held.erase(0, end);
+  }
+}
 
-    case '-':
-      in.get(c);
-      if (! in.eof()) {
-        if (! is_letter(last)) {
-          in.unget();
-        }
-        else if (c == 'i') {
-          in.get(c);
-          if (in.eof()) {
-            last.flags |= TF_IZAAFIH;
-            break;
-          } else {
-            if (isspace(c)) {
-              last.flags |= TF_IZAAFIH;
-              in.unget();        // let it be separate words
-              break;
-            }
-            else if (c == 'i') {
-              in.get(c);
-              if (in.eof()) {
-                push(out, SUFFIX_II, TF_NO_FLAGS);
-                break;
-              } else {
-                if (isspace(c)) {
-                  push(out, SUFFIX_II, TF_NO_FLAGS);
-                  in.unget();
-                  break;
-                }
-                in.unget();
-              }
-            }
-            in.unget();
-          }
-	  in.unget();
-        }
-        else if (c == 'r' || c == 'h') {
-          int f = c;
-          in.get(c);
-          if (! in.eof()) {
-            if (c == 'a') {
-              in.get(c);
-              if (! in.eof()) {
-                if (c == 'a') {
-                  in.get(c);
-                  if (in.eof()) {
-                    push(out, f == 'r' ? SUFFIX_RAA : SUFFIX_HAA,
-                         TF_NO_FLAGS);
-                    break;
-                  } else {
-                    if (isspace(c)) {
-                      push(out, f == 'r' ? SUFFIX_RAA : SUFFIX_HAA,
-                           TF_NO_FLAGS);
-                      in.unget();
-                      break;
-                    }
-                    in.unget();
-                  }
-                }
-                in.unget();
-              }
-            }
-            in.unget();
-          }
-	  in.unget();
-        } else {
-          in.unget();
-        }
-      }
-      push(out, SPACER, TF_NO_FLAGS);
-      break;
+void aasaan_parser_t::finish(elements_t& out)
+{
+  parse(held.length(), false, out);
+  held.clear();
+}
 
-    default:
-      push(out, UNKNOWN, (unsigned long) c);
-      break;
+// The tokens held back are left ahead of the text, so that the parse
+// looks back at them just as it would in the whole input; a doubled
+// letter may reach two tokens back, to mark an al- as a sun letter.
 
-    case '\t':
-    case ' ':
-    case '\n': {
-      // Gobble up multiple whitespace characters; they
-      // collapse into SPACE, unless there are two returns,
-      // in which case it is a paragraph separator
+void aasaan_parser_t::parse(std::size_t len, bool more, elements_t& out)
+{
+  std::size_t pos = 0;
+  parse_aasaan(ctx, held.data(), len, pos, tokens, mode, false);
 
-      int ret = 0;
-      while (in.get(c) && ! in.eof() && isspace(c)) {
-        if (c == '\n') ret++;
-      }
-      if (! in.eof())
-        in.unget();
+  std::size_t keep = 0;
+  if (more)
+    keep = tokens.size() < 2 ? tokens.size() : 2;
 
-      if (ret > 1)
-        push(out, PARAGRAPH, TF_NO_FLAGS);
-      else
-        push(out, SPACE, TF_NO_FLAGS);
-      break;
-    }
-    }
+  out.insert(out.end(), tokens.begin(), tokens.end() - keep);
+  tokens.erase(tokens.begin(), tokens.end() - keep);
+}
 
-    if (! (last.flags & TF_SHADDA) && is_sukun(last) &&
-        &last != &out.back() && last == out.back())
-      {
-        last.flags |= TF_SHADDA;
-        out.pop_back();
+// Talattof is an 8-bit encoding, and nearly every byte of it stands
+// for one token whatever surrounds it.  Those bytes are listed here;
+// any other byte reads as EXCLAM, save the four parse_talattof handles
+// itself because they depend on the token before them: hamza with
+// alif, alif, tanween and izaafih.
+
+struct talattof_byte_t {
+  char		byte;
+  token_t	token;
+  unsigned long flags;
+};
+
+static const talattof_byte_t talattof_bytes[] = {
+  { '\015', PARAGRAPH,	TF_NO_FLAGS },
+
+  { '\040', SPACE,	TF_NO_FLAGS },
+  { '\240', SPACE,	TF_NO_FLAGS },
+  { '\256', PERIOD,	TF_NO_FLAGS },
+
+  { '\302', ALIF,	TF_VOWEL | TF_FATHA | TF_BAA_KULAA },
+
+  { '\310', BIH,	TF_CONSONANT },
+  { '\312', TIH,	TF_CONSONANT },
+  { '\313', THIH,	TF_CONSONANT },
+  { '\314', JIIM,	TF_CONSONANT },
+  { '\315', HIH_HUTII,	TF_CONSONANT },
+  { '\316', KHIH,	TF_CONSONANT },
+  { '\317', DAAL,	TF_CONSONANT },
+  { '\320', DHAAL,	TF_CONSONANT },
+  { '\321', RIH,	TF_CONSONANT },
+  { '\322', ZIH,	TF_CONSONANT },
+  { '\323', SIIN,	TF_CONSONANT },
+  { '\324', SHIIN,	TF_CONSONANT },
+  { '\325', SAAD,	TF_CONSONANT },
+  { '\326', THAAD,	TF_CONSONANT },
+  { '\327', TAYN,	TF_CONSONANT },
+  { '\330', DTHAYN,	TF_CONSONANT },
+  { '\331', AYN,	TF_CONSONANT },
+  { '\332', GHAYN,	TF_CONSONANT },
+  { '\341', FIH,	TF_CONSONANT },
+  { '\342', QAAF,	TF_CONSONANT },
+  { '\343', KAAF,	TF_CONSONANT },
+  { '\344', LAAM,	TF_CONSONANT },
+  { '\345', MIIM,	TF_CONSONANT },
+  { '\346', NUUN,	TF_CONSONANT },
+  { '\347', HIH,	TF_CONSONANT },
+  { '\350', WAAW,	TF_CONSONANT },
+  { '\351', YIH,	TF_CONSONANT }, // final
+  { '\352', YIH,	TF_CONSONANT },
+
+  { '\354', HAMZA,	TF_CONSONANT },
+
+  { '\363', PIH,	TF_CONSONANT },
+  { '\370', GAAF,	TF_CONSONANT },
+  { '\376', ZHIH,	TF_CONSONANT }
+};
+
+// The token of every byte, built once from the list above.  The bytes
+// that depend on their context map to NONE.
+
+class talattof_table_t
+{
+  element_t elems[256];
 
-        // Check if this is a sun letter
-        std::list<element_t>::iterator i = out.end();
-        i--; assert(*i == out.back());
-        i--;
+public:
+  talattof_table_t() {
+    for (unsigned int i = 0; i < 256; i++)
+      elems[i] = element_t(EXCLAM, TF_NO_FLAGS);
 
-        if (i->token == PREFIX_AL)
-          i->flags |= TF_SUN_LETTER;
-      }
+    for (unsigned int i = 0;
+         i < sizeof(talattof_bytes) / sizeof(talattof_bytes[0]); i++)
+      elems[(unsigned char) talattof_bytes[i].byte] =
+        element_t(talattof_bytes[i].token, talattof_bytes[i].flags);
 
-    if (capitalize_next) {
-      out.back().flags |= TF_CAPITALIZE;
-      capitalize_next = false;
-    }
+    elems[0306] = elems[0307] = elems[0353] = elems[0360] = element_t(NONE);
+  }
 
-  NEXT:
-    if (only_one && ! capitalize_next)
-      break;
-    else if (! in.eof())
-      in.get(c);
+  const element_t& operator[](char byte) const {
+    return elems[(unsigned char) byte];
   }
+};
 
-  return start_size != out.size();
-}
+static const talattof_table_t talattof_table;
 
-bool parse_talattof(std::istream& in, std::list<element_t>& out,
-                    mode_t mode, bool only_one)
+bool parse_talattof(context_t&, const char * in, std::size_t len,
+                    elements_t& out, mode_t, bool = false)
 {
-  char c;
-  unsigned int start_size = out.size();
-
-  in.get(c);
-  while (! in.eof()) {
-    element_t& last = out.back();
+  std::size_t start_size = out.size();
+  element_t none;
+
+  // Nearly every byte yields a token, so make room for them up front
+  if (out.capacity() < start_size + len)
+    out.reserve(std::max(start_size + len, 2 * out.capacity()));
+
+  for (std::size_t pos = 0; pos < len; pos++) {
+    const element_t& elem(talattof_table[in[pos]]);
+    if (elem.token != NONE) {
+      out.push_back(elem);
+      continue;
+    }
 
-    switch (c) {
-    case '\015': push(out, PARAGRAPH, TF_NO_FLAGS); break;
-
-    case '\040': push(out, SPACE, TF_NO_FLAGS); break;
-    case '\240': push(out, SPACE, TF_NO_FLAGS); break;
-    case '\256': push(out, PERIOD, TF_NO_FLAGS); break;
-
-#if 0
-    case '\260': push(out, ZERO, TF_NO_FLAGS); break;
-    case '\261': push(out, ONE, TF_NO_FLAGS); break;
-    case '\262': push(out, TWO, TF_NO_FLAGS); break;
-    case '\263': push(out, THREE, TF_NO_FLAGS); break;
-    case '\264': push(out, FOUR, TF_NO_FLAGS); break;
-    case '\265': push(out, FIVE, TF_NO_FLAGS); break;
-    case '\266': push(out, SIX, TF_NO_FLAGS); break;
-    case '\267': push(out, SEVEN, TF_NO_FLAGS); break;
-    case '\270': push(out, EIGHT, TF_NO_FLAGS); break;
-    case '\271': push(out, NINE, TF_NO_FLAGS); break;
-#endif
+    std::size_t prior = out.size();
+    element_t * last = prior ? &out.back() : &none;
 
-    case '\302':
-      push(out, ALIF, TF_VOWEL | TF_FATHA | TF_BAA_KULAA);
-      break;
-            
+    switch (in[pos]) {
     case '\306':
       push(out, HAMZA, TF_CONSONANT | TF_KASRA);
+      if (prior)
+        last = &out[prior - 1];
+      // fall through...
 
     case '\307':
-      if (is_letter(last))
+      if (is_letter(*last))
         push(out, ALIF, TF_VOWEL | TF_FATHA);
       else
         push(out, ALIF, TF_CONSONANT | TF_FATHA);
       break;
 
-    case '\310': push(out, BIH, TF_CONSONANT); break;
-    case '\312': push(out, TIH, TF_CONSONANT); break;
-    case '\313': push(out, THIH, TF_CONSONANT); break;
-    case '\314': push(out, JIIM, TF_CONSONANT); break;
-    case '\315': push(out, HIH_HUTII, TF_CONSONANT); break;
-    case '\316': push(out, KHIH, TF_CONSONANT); break;
-    case '\317': push(out, DAAL, TF_CONSONANT); break;
-    case '\320': push(out, DHAAL, TF_CONSONANT); break;
-    case '\321': push(out, RIH, TF_CONSONANT); break;
-    case '\322': push(out, ZIH, TF_CONSONANT); break;
-    case '\323': push(out, SIIN, TF_CONSONANT); break;
-    case '\324': push(out, SHIIN, TF_CONSONANT); break;
-    case '\325': push(out, SAAD, TF_CONSONANT); break;
-    case '\326': push(out, THAAD, TF_CONSONANT); break;
-    case '\327': push(out, TAYN, TF_CONSONANT); break;
-    case '\330': push(out, DTHAYN, TF_CONSONANT); break;
-    case '\331': push(out, AYN, TF_CONSONANT); break;
-    case '\332': push(out, GHAYN, TF_CONSONANT); break;
-    case '\341': push(out, FIH, TF_CONSONANT); break;
-    case '\342': push(out, QAAF, TF_CONSONANT); break;
-    case '\343': push(out, KAAF, TF_CONSONANT); break;
-    case '\344': push(out, LAAM, TF_CONSONANT); break;
-    case '\345': push(out, MIIM, TF_CONSONANT); break;
-    case '\346': push(out, NUUN, TF_CONSONANT); break;
-    case '\347': push(out, HIH, TF_CONSONANT); break;
-    case '\350': push(out, WAAW, TF_CONSONANT); break;
-    case '\351': push(out, YIH, TF_CONSONANT); break; // final
-    case '\352': push(out, YIH, TF_CONSONANT); break;
-
-    case '\354': push(out, HAMZA, TF_CONSONANT); break;
-
     case '\353':
-      if (is_letter(last)) {
-        if (last.token == ALIF) {
+      if (is_letter(*last)) {
+        if (last->token == ALIF) {
           out.pop_back();
-          out.back().flags |= TF_FATHA | TF_TANWEEN;
+          if (! out.empty())
+            out.back().flags |= TF_FATHA | TF_TANWEEN;
         } else {
-          last.flags |= TF_TANWEEN;
+          last->flags |= TF_TANWEEN;
         }
       }
       break;
 
     case '\360':
-      if (is_letter(last))
-        last.flags |= TF_IZAAFIH | TF_EXPLICIT;
+      if (is_letter(*last))
+        last->flags |= TF_IZAAFIH | TF_EXPLICIT;
       break;
-
-    case '\363': push(out, PIH, TF_CONSONANT); break;
-    case '\370': push(out, GAAF, TF_CONSONANT); break;
-    case '\376': push(out, ZHIH, TF_CONSONANT); break;
-
-    default: push(out, EXCLAM, TF_NO_FLAGS); break;
     }
-
-    if (! in.eof())
-      in.get(c);
   }
 
   return start_size != out.size();
 }
 
-// Output functions
-
-bool output_aasaan_letter(std::list<element_t>::iterator letter,
-                          std::list<element_t>::iterator end,
-                          std::ostream& out, mode_t mode,
-                          bool quiet_shadda)
+bool parse_talattof(context_t& ctx, std::istream& in, elements_t& out,
+                    mode_t mode, bool only_one = false)
 {
-  switch (letter->token) {
-  case ALIF:
-    if (letter->flags & TF_VOWEL)
-      out << 'a';
-    break;
-
-  case BIH:
-    out << 'b';
-    break;
+  ctx.buffer.assign(std::istreambuf_iterator<char>(in),
+                    std::istreambuf_iterator<char>());
+  return parse_talattof(ctx, ctx.buffer.data(), ctx.buffer.length(), out,
+                        mode, only_one);
+}
 
-  case TIH:
-    out << 't';
-    break;
+// Arabic script arrives as UTF-8.  A sequence that is not valid UTF-8
+// -- a stray continuation byte, a truncated or overlong sequence, a
+// surrogate or a code point past U+10FFFF -- decodes as U+FFFD and
+// consumes only its first byte, so decoding resumes at the next.
 
-  case THIH:
-    out << "th";
-    break;
+static const unsigned int utf8_invalid = 0xFFFD;
 
-  case JIIM:
-    out << 'j';
-    break;
+static inline unsigned int utf8_decode(const char * in, std::size_t len,
+                                       std::size_t& pos)
+{
+  unsigned int c = (unsigned char) in[pos++];
+  if (c < 0x80)
+    return c;
 
-  case HIH_HUTII:
-    out << ".h";
-    break;
+  const unsigned char * p = (const unsigned char *) in + pos;
+  std::size_t left = len - pos;
 
-  case KHIH:
-    out << "kh";
-    break;
+  if (c >= 0xC2 && c < 0xE0) {
+    if (left >= 1 && (p[0] & 0xC0) == 0x80) {
+      pos += 1;
+      return ((c & 0x1F) << 6) | (p[0] & 0x3F);
+    }
+  }
+  else if (c >= 0xE0 && c < 0xF0) {
+    if (left >= 2 && (p[0] & 0xC0) == 0x80 && (p[1] & 0xC0) == 0x80) {
+      unsigned int cp = (((c & 0x0F) << 12) | ((p[0] & 0x3F) << 6) |
+                         (p[1] & 0x3F));
+      if (cp >= 0x800 && (cp < 0xD800 || cp > 0xDFFF)) {
+        pos += 2;
+        return cp;
+      }
+    }
+  }
+  else if (c >= 0xF0 && c < 0xF5) {
+    if (left >= 3 && (p[0] & 0xC0) == 0x80 && (p[1] & 0xC0) == 0x80 &&
+        (p[2] & 0xC0) == 0x80) {
+      unsigned int cp = (((c & 0x07) << 18) | ((p[0] & 0x3F) << 12) |
+                         ((p[1] & 0x3F) << 6) | (p[2] & 0x3F));
+      if (cp >= 0x10000 && cp <= 0x10FFFF) {
+        pos += 3;
+        return cp;
+      }
+    }
+  }
+  return utf8_invalid;
+}
 
-  case SIIN:
-    out << 's';
-    break;
+inline unsigned int utf8_peek(const char * in, std::size_t len,
+                              std::size_t pos)
+{
+  return pos < len ? utf8_decode(in, len, pos) : 0;
+}
 
-  case SHIIN:
-    out << "sh";
-    break;
+// The letters and punctuation of the Arabic block that stand for one
+// token wherever they appear.  Alif, waaw, yih and hih, the hamza seat
+// that may begin the article, and the vowel marks depend on what is
+// around them, and parse_unicode handles those itself.  As in Talattof
+// the seat of a hamza gives it the vowel the seat implies; a vowel
+// mark written on the hamza replaces it.
+
+struct unicode_char_t {
+  unsigned short code;
+  token_t	 token;
+  unsigned long	 flags;
+};
+
+static const unicode_char_t unicode_chars[] = {
+  { 0x060C, COMMA,	  TF_NO_FLAGS },
+  { 0x061B, SEMICOLON,	  TF_NO_FLAGS },
+  { 0x061F, QUERY,	  TF_NO_FLAGS },
+
+  { 0x0621, HAMZA,	  TF_CONSONANT },
+  { 0x0622, ALIF,	  TF_VOWEL | TF_BAA_KULAA },
+  { 0x0624, HAMZA,	  TF_CONSONANT | TF_DHAMMA },
+  { 0x0625, HAMZA,	  TF_CONSONANT | TF_KASRA },
+  { 0x0626, HAMZA,	  TF_CONSONANT | TF_KASRA },
+  { 0x0628, BIH,	  TF_CONSONANT },
+  { 0x0629, TIH_MARBUTA,  TF_CONSONANT },
+  { 0x062A, TIH,	  TF_CONSONANT },
+  { 0x062B, THIH,	  TF_CONSONANT },
+  { 0x062C, JIIM,	  TF_CONSONANT },
+  { 0x062D, HIH_HUTII,	  TF_CONSONANT },
+  { 0x062E, KHIH,	  TF_CONSONANT },
+  { 0x062F, DAAL,	  TF_CONSONANT },
+  { 0x0630, DHAAL,	  TF_CONSONANT },
+  { 0x0631, RIH,	  TF_CONSONANT },
+  { 0x0632, ZIH,	  TF_CONSONANT },
+  { 0x0633, SIIN,	  TF_CONSONANT },
+  { 0x0634, SHIIN,	  TF_CONSONANT },
+  { 0x0635, SAAD,	  TF_CONSONANT },
+  { 0x0636, THAAD,	  TF_CONSONANT },
+  { 0x0637, TAYN,	  TF_CONSONANT },
+  { 0x0638, DTHAYN,	  TF_CONSONANT },
+  { 0x0639, AYN,	  TF_CONSONANT },
+  { 0x063A, GHAYN,	  TF_CONSONANT },
+  { 0x0641, FIH,	  TF_CONSONANT },
+  { 0x0642, QAAF,	  TF_CONSONANT },
+  { 0x0643, KAAF,	  TF_CONSONANT },
+  { 0x0644, LAAM,	  TF_CONSONANT },
+  { 0x0645, MIIM,	  TF_CONSONANT },
+  { 0x0646, NUUN,	  TF_CONSONANT },
+  { 0x0649, ALIF_MAQSURA, TF_VOWEL },
+
+  { 0x067E, PIH,	  TF_CONSONANT },
+  { 0x0686, CHIH,	  TF_CONSONANT },
+  { 0x0698, ZHIH,	  TF_CONSONANT },
+  { 0x06A9, KAAF,	  TF_CONSONANT },
+  { 0x06AF, GAAF,	  TF_CONSONANT },
+  { 0x06C0, HIH,	  TF_CONSONANT | TF_SILENT | TF_IZAAFIH },
+
+  { 0x06D4, PERIOD,	  TF_NO_FLAGS }
+};
+
+// The token of every code point from U+0600 to U+06FF, built once from
+// the list above.  Those parse_unicode decides for itself, and those
+// it does not know, map to NONE.
+
+class unicode_input_table_t
+{
+  element_t elems[256];
+
+public:
+  unicode_input_table_t() {
+    for (unsigned int i = 0;
+         i < sizeof(unicode_chars) / sizeof(unicode_chars[0]); i++)
+      elems[unicode_chars[i].code - 0x0600] =
+        element_t(unicode_chars[i].token, unicode_chars[i].flags);
+  }
 
-  case DAAL:
-    out << 'd';
-    break;
+  const element_t& operator[](unsigned int code) const {
+    return elems[code - 0x0600];
+  }
+};
 
-  case DHAAL:
-    out << "dh";
-    break;
+static const unicode_input_table_t unicode_input;
 
-  case RIH:
-    out << 'r';
-    break;
+// Whether `code' is a letter of the script, or a mark written on one.
+// The article is only taken as such before a letter, and a word only
+// ends where neither follows.
 
-  case ZIH:
-    out << 'z';
-    break;
+inline bool unicode_letter(unsigned int code)
+{
+  if (code < 0x0600 || code > 0x06FF)
+    return false;
+  if (is_letter(unicode_input[code]))
+    return true;
 
-  case SAAD:
-    out << ".s";
-    break;
+  switch (code) {
+  case 0x0623: case 0x0627: case 0x0647: case 0x0648:
+  case 0x064A: case 0x0671: case 0x06CC:
+    return true;
+  default:
+    return false;
+  }
+}
 
-  case THAAD:
-    out << ".d";
-    break;
+inline bool unicode_in_word(unsigned int code)
+{
+  return unicode_letter(code) || (code >= 0x064B && code <= 0x0655) ||
+    code == 0x0670;
+}
 
-  case TAYN:
-    out << ".t";
-    break;
+// If the alif just read (`alif', with `pos' past it) begins the
+// article, return the position after its laam; otherwise `pos'.  A
+// plain alif or alif wasla followed by laam and a letter is the
+// article.  With a hamza seat it is only taken for one when written
+// out in full, as the renderer writes it: أَلْ.
 
-  case DTHAYN:
-    out << ".z";
-    break;
+static std::size_t unicode_article(const char * in, std::size_t len,
+                                   std::size_t pos, unsigned int alif)
+{
+  std::size_t	p    = pos;
+  unsigned int	c    = p < len ? utf8_decode(in, len, p) : 0;
+  bool		full = c == 0x064E;
+
+  if (full)
+    c = p < len ? utf8_decode(in, len, p) : 0;
+  if (c != 0x0644)
+    return pos;
+
+  std::size_t end = p;
+  c = p < len ? utf8_decode(in, len, p) : 0;
+  if (c == 0x0652) {
+    end = p;
+    c = p < len ? utf8_decode(in, len, p) : 0;
+  } else {
+    full = false;
+  }
 
-  case AYN:
-    out << '`';
-    break;
+  if ((alif == 0x0623 && ! full) || ! unicode_letter(c))
+    return pos;
+  return end;
+}
 
-  case GHAYN:
-    out << "gh";
-    break;
+// A waaw or yih after `last' is taken for a consonant at the start of
+// a word, after fatha (as Aasaan reads "ay" and "aw") or after a long
+// vowel, and for a long vowel otherwise.  A vowel mark written on it
+// later makes it a consonant after all, as it does a long alif, which
+// must then be the carrier of the vowel.
 
-  case FIH:
-    out << 'f';
-    break;
+inline unsigned long unicode_weak_letter(const element_t& last)
+{
+  if (! is_letter(last) || last.flags & (TF_VOWEL | TF_FATHA))
+    return TF_CONSONANT;
+  return TF_VOWEL;
+}
 
-  case QAAF:
-    out << 'q';
-    break;
+inline void unicode_vowel(element_t& letter, unsigned long vowel)
+{
+  unsigned long flags = letter.flags & ~(TF_FATHA | TF_KASRA | TF_DHAMMA);
+  if (vowel && flags & TF_VOWEL) {
+    if (letter.token == WAAW || letter.token == YIH)
+      flags = (flags & ~TF_VOWEL) | TF_CONSONANT;
+    else if (letter.token == ALIF && ! (flags & TF_BAA_KULAA))
+      flags = (flags & ~TF_VOWEL) | TF_CONSONANT | TF_CARRIER;
+  }
+  letter.set_flags(flags | vowel);
+}
 
-  case KAAF:
-    out << 'k';
-    break;
+bool parse_unicode(context_t&, const char * in, std::size_t len,
+                   elements_t& out, mode_t mode, bool = false)
+{
+  static const unsigned long marks[] = {
+    TF_FATHA, TF_DHAMMA, TF_KASRA, TF_FATHA, TF_DHAMMA, TF_KASRA
+  };
 
-  case LAAM:
-    out << 'l';
-    break;
+  std::size_t start_size = out.size();
+  element_t none;
 
-  case MIIM:
-    out << 'm';
-    break;
+  // Most code points of the script take two bytes and yield a token
+  if (out.capacity() < start_size + len / 2)
+    out.reserve(std::max(start_size + len / 2, 2 * out.capacity()));
 
-  case NUUN:
-    out << 'n';
-    break;
+  std::size_t pos = 0;
+  while (pos < len) {
+    std::size_t	 start = pos;
+    unsigned int c     = utf8_decode(in, len, pos);
 
-  case WAAW:
-    if (letter->flags & TF_DIPHTHONG) {
-      out << 'w';
-    }
-    else if (letter->flags & TF_CONSONANT) {
-      if (mode == ARABIC)
-        out << 'w';
-      else
-        out << 'v';
+    if (c >= 0x0600 && c <= 0x06FF) {
+      const element_t& elem(unicode_input[c]);
+      if (elem.token != NONE) {
+        out.push_back(elem);
+        continue;
+      }
     }
-    else if (letter->flags & TF_VOWEL) {
-      if (letter->flags & TF_SILENT)
-        out << 'o';
-      else if (letter->flags & TF_SILENT_ALIF)
-        out << "UA";
-      else
-        out << 'u';
+
+    std::size_t prior = out.size();
+    element_t * last = prior ? &out.back() : &none;
+
+    switch (c) {
+    case '\t': case '\n': case '\v': case '\f': case '\r': case ' ': {
+      int newlines = 0;
+      pos = aasaan_space_run(in, len, start, newlines);
+      push(out, newlines > 1 ? PARAGRAPH : SPACE, TF_NO_FLAGS);
+      break;
     }
-    break;
 
-  case YIH:
-    if (letter->flags & (TF_CONSONANT | TF_DIPHTHONG))
-      out << 'y';
-    else if (letter->flags & TF_VOWEL) {
-      out << 'i';
+    case '.': push(out, PERIOD,    TF_NO_FLAGS); break;
+    case ',': push(out, COMMA,     TF_NO_FLAGS); break;
+    case ';': push(out, SEMICOLON, TF_NO_FLAGS); break;
+    case ':': push(out, COLON,     TF_NO_FLAGS); break;
+    case '!': push(out, EXCLAM,    TF_NO_FLAGS); break;
+    case '?': push(out, QUERY,     TF_NO_FLAGS); break;
+
+    case 0x00AB: push(out, LEFT_QUOTE,  TF_NO_FLAGS); break;
+    case 0x00BB: push(out, RIGHT_QUOTE, TF_NO_FLAGS); break;
+
+    case 0x0623:		// alif with hamza above
+    case 0x0627:		// alif
+    case 0x0671:		// alif wasla
+      if (! is_letter(*last) && last->token != SPACER) {
+        std::size_t end = unicode_article(in, len, pos, c);
+        if (end != pos) {
+          pos = end;
+          push(out, PREFIX_AL, TF_NO_FLAGS);
+        }
+        else if (c == 0x0623) {
+          push(out, HAMZA, TF_CONSONANT | TF_FATHA);
+        }
+        else {
+          push(out, ALIF, TF_CONSONANT | TF_CARRIER);
+        }
+      }
+      else if (c == 0x0623) {
+        push(out, HAMZA, TF_CONSONANT | TF_FATHA);
+      }
+      else if (last->flags & (TF_KASRA | TF_DHAMMA)) {
+        // after kasra or dhamma, alif only carries the next vowel
+        push(out, ALIF, TF_CONSONANT | TF_CARRIER);
+      }
+      else if (! (last->flags & TF_TANWEEN && last->flags & TF_FATHA)) {
+        // otherwise it is the alif that carries tanween.  No long vowel
+        // comes before a long alif, so a waaw or yih there is a consonant.
+        if ((last->token == WAAW || last->token == YIH) &&
+            last->flags & TF_VOWEL)
+          last->set_flags((last->flags & ~TF_VOWEL) | TF_CONSONANT);
+        push(out, ALIF, TF_VOWEL);
+      }
+      break;
+
+    case 0x0647: {		// hih
+      unsigned long flags = TF_CONSONANT;
+      if (mode == PERSIAN && last->flags & TF_CONSONANT &&
+          ! (last->flags & TF_DIPHTHONG) &&
+          ! unicode_in_word(utf8_peek(in, len, pos)))
+        flags |= TF_SILENT;
+      push(out, HIH, flags);
+      break;
     }
-    break;
 
-  case ALIF_MAQSURA:
-    out << 'Y';
-    break;
+    case 0x0648:		// waaw
+      push(out, WAAW, unicode_weak_letter(*last));
+      break;
 
-  case HIH:
-    if (letter->flags & TF_SILENT || mode == ARABIC) {
-      out << 'h';
-    } else {
-      std::list<element_t>::iterator prev = letter; prev--;
-      std::list<element_t>::iterator next = letter; next++;
+    case 0x064A:		// Arabic yih
+    case 0x06CC:		// Persian yih
+      push(out, YIH, unicode_weak_letter(*last));
+      break;
 
-      if (is_sukun(*letter) &&
-          (next == end || ! is_letter(*next)) &&
-          ! (prev->flags & (TF_VOWEL | TF_DIPHTHONG |
-                            TF_DEFECTIVE_ALIF)))
-        {
-          out << 'H';
-        } else {
-        out << 'h';
+    case 0x064B:		// fathatan
+      if (last->token == ALIF && last->flags & TF_VOWEL && prior > 1 &&
+          is_letter(out[prior - 2])) {
+        out.pop_back();
+        last = &out.back();
       }
-    }
-    break;
+      // fall through...
 
-  case TIH_MARBUTA:
-    out << 'T';
-    break;
+    case 0x064C:		// dhammatan
+    case 0x064D:		// kasratan
+    case 0x064E:		// fatha
+    case 0x064F:		// dhamma
+    case 0x0650:		// kasra
+      // The kasra after an izaafih is that of the izaafih
+      if (! is_letter(*last) || (c == 0x0650 && last->flags & TF_IZAAFIH))
+        break;
+      unicode_vowel(*last, marks[c - 0x064B]);
+      if (c <= 0x064D)
+        last->flags |= TF_TANWEEN;
+      break;
 
-  case HAMZA:
-    out << '\'';
-    break;
+    case 0x0651:		// shadda
+      if (! is_letter(*last))
+        break;
+      if ((last->token == WAAW || last->token == YIH) &&
+          last->flags & TF_VOWEL)
+        last->set_flags((last->flags & ~TF_VOWEL) | TF_CONSONANT);
+      last->flags |= TF_SHADDA;
+      if (prior > 1 && out[prior - 2].token == PREFIX_AL)
+        out[prior - 2].flags |= TF_SUN_LETTER;
+      break;
 
+    case 0x0652:		// sukun
+      if (is_letter(*last))
+        unicode_vowel(*last, 0);
+      break;
 
-    // Persian letters
+    case 0x0654:		// hamza above
+      if (last->token == HIH)
+        last->flags |= TF_SILENT | TF_IZAAFIH;
+      else if (last->token == ALIF)
+        *last = element_t(HAMZA, TF_CONSONANT | TF_FATHA);
+      else if (last->token == WAAW)
+        *last = element_t(HAMZA, TF_CONSONANT | TF_DHAMMA);
+      else if (last->token == YIH)
+        *last = element_t(HAMZA, TF_CONSONANT | TF_KASRA);
+      break;
 
-  case PIH:
-    out << 'p';
-    break;
+    case 0x0655:		// hamza below
+      if (last->token == ALIF)
+        *last = element_t(HAMZA, TF_CONSONANT | TF_KASRA);
+      break;
 
-  case CHIH:
-    out << "ch";
-    break;
+    case 0x0670:		// superscript alif
+      if (is_letter(*last) && last->token != ALIF_MAQSURA)
+        last->flags |= TF_DEFECTIVE_ALIF;
+      break;
 
-  case ZHIH:
-    out << "zh";
-    break;
+    case 0x0640:		// tatweel
+    case 0x200D:		// zero width joiner
+    case 0xFEFF:		// byte order mark
+      break;
 
-  case GAAF:
-    out << 'g';
-    break;
+    case 0x200C:		// zero width non-joiner
+    case 0x202F:		// narrow no-break space
+      if (prior > 1 && last->token == YIH &&
+          out[prior - 2].token == MIIM &&
+          (prior == 2 || ! is_letter(out[prior - 3]))) {
+        out.resize(prior - 2);
+        push(out, PREFIX_MII, TF_NO_FLAGS);
+      } else {
+        push(out, SPACER, TF_NO_FLAGS);
+      }
+      break;
 
-  default:
-    return false;
+    case 0x2009: {		// thin space, as set inside quotes and before را
+      std::size_t next = pos;
+      c = utf8_peek(in, len, next);
+      if (last->token == LEFT_QUOTE || c == 0x00BB)
+        break;
+      if (c == 0x0631 && is_letter(*last)) {
+        utf8_decode(in, len, next);
+        if (utf8_peek(in, len, next) == 0x0627) {
+          utf8_decode(in, len, next);
+          if (! unicode_in_word(utf8_peek(in, len, next))) {
+            pos = next;
+            push(out, SUFFIX_RAA, TF_NO_FLAGS);
+            break;
+          }
+        }
+      }
+      push(out, SPACE, TF_NO_FLAGS);
+      break;
+    }
+
+    default: {
+      // Anything else passes through a byte at a time
+      const char * bytes = in + start;
+      std::size_t  count = pos - start;
+      if (c == utf8_invalid) {
+        bytes = "\357\277\275";
+        count = 3;
+      }
+      for (std::size_t i = 0; i < count; i++)
+        push(out, UNKNOWN, (unsigned char) bytes[i]);
+      break;
+    }
+    }
   }
 
-  if (letter->flags & TF_SHADDA && quiet_shadda)
+  return start_size != out.size();
+}
+
+bool parse_unicode(context_t& ctx, std::istream& in, elements_t& out,
+                   mode_t mode, bool only_one = false)
+{
+  ctx.buffer.assign(std::istreambuf_iterator<char>(in),
+                    std::istreambuf_iterator<char>());
+  return parse_unicode(ctx, ctx.buffer.data(), ctx.buffer.length(), out,
+                       mode, only_one);
+}
+
+// Output functions
+
+// Renderers write to a sink rather than to a std::ostream.  A sink is
+// an append-only run of bytes whose fast path is inline: a byte or a
+// short string is copied straight into its buffer, and only when that
+// is full does the kind of sink in use get a say, through overflow().
+// This avoids the sentry, locale and virtual call that every insertion
+// into an ostream costs, which dominate when a renderer writes a few
+// bytes at a time.
+
+class sink_t
+{
+protected:
+  char * next;			// where the next byte goes
+  char * limit;			// one past the room available
+
+  sink_t() : next(NULL), limit(NULL) { }
+
+  // Called when the `n' bytes at `s' do not fit before `limit'
+  virtual void overflow(const char * s, std::size_t n) = 0;
+
+public:
+  virtual ~sink_t() { }
+
+  // Pass on whatever is still held in the buffer
+  virtual void flush() { }
+
+  void put(char c) {
+    if (next != limit)
+      *next++ = c;
+    else
+      overflow(&c, 1);
+  }
+
+  void write(const char * s, std::size_t n) {
+    if (n <= std::size_t(limit - next)) {
+      std::memcpy(next, s, n);
+      next += n;
+    } else {
+      overflow(s, n);
+    }
+  }
+
+  sink_t& operator<<(char c) {
+    put(c);
+    return *this;
+  }
+  sink_t& operator<<(const char * s) {
+    write(s, std::strlen(s));
+    return *this;
+  }
+  sink_t& operator<<(const std::string& s) {
+    write(s.data(), s.length());
+    return *this;
+  }
+  sink_t& operator<<(unsigned int n) {
+    char   digits[16];
+    char * p = digits + sizeof(digits);
+    do {
+      *--p = char('0' + n % 10);
+    } while (n /= 10);
+    write(p, digits + sizeof(digits) - p);
+    return *this;
+  }
+};
+
+// Appends to a string, growing it as needed.  Until flush(), which the
+// destructor calls, the string has unwritten room at its end, and must
+// not be touched by anyone else.
+
+class string_sink_t : public sink_t
+{
+  std::string& str;
+
+public:
+  string_sink_t(std::string& s) : str(s) {
+    next = limit = &str[0] + str.length();
+  }
+  ~string_sink_t() {
+    flush();
+  }
+
+  virtual void flush() {
+    str.resize(next - &str[0]);
+    next = limit = &str[0] + str.length();
+  }
+
+protected:
+  virtual void overflow(const char * s, std::size_t n) {
+    std::size_t used = next - &str[0];
+    std::size_t size = str.length() * 2;
+    if (size < used + n)
+      size = used + n;
+    if (size < 256)
+      size = 256;
+
+    str.resize(size);
+    next  = &str[0] + used;
+    limit = &str[0] + size;
+
+    std::memcpy(next, s, n);
+    next += n;
+  }
+};
+
+// Writes into a caller's fixed-size buffer, always leaving room for a
+// terminating NUL.  Whatever does not fit is counted rather than
+// stored, so the caller learns how much room it needed.
+
+class fixed_sink_t : public sink_t
+{
+  char *      start;
+  std::size_t dropped;
+  char	      none;		// stands in for a buffer of no size
+
+public:
+  fixed_sink_t(char * buf, std::size_t capacity) : dropped(0) {
+    if (capacity > 0) {
+      start = next = buf;
+      limit = buf + capacity - 1;
+    } else {
+      start = next = limit = &none;
+    }
+  }
+
+  std::size_t needed() const {
+    return (next - start) + dropped;
+  }
+
+  void terminate() {
+    *next = '\0';
+  }
+
+protected:
+  virtual void overflow(const char * s, std::size_t n) {
+    std::size_t room = limit - next;
+    std::memcpy(next, s, room);
+    next    += room;
+    dropped += n - room;
+  }
+};
+
+// Collects output for a std::ostream and passes it on in large blocks
+
+class stream_sink_t : public sink_t
+{
+  std::ostream& out;
+  char		block[8192];
+
+public:
+  stream_sink_t(std::ostream& o) : out(o) {
+    next  = block;
+    limit = block + sizeof(block);
+  }
+  ~stream_sink_t() {
+    flush();
+  }
+
+  virtual void flush() {
+    out.write(block, next - block);
+    next = block;
+  }
+
+protected:
+  virtual void overflow(const char * s, std::size_t n) {
+    flush();
+    if (n >= sizeof(block)) {
+      out.write(s, n);
+    } else {
+      std::memcpy(next, s, n);
+      next += n;
+    }
+  }
+};
+
+// Most tokens are written the same way whatever surrounds them, so
+// each renderer looks those up in a table indexed by token, leaving
+// its switch statements for the few that depend on their flags or
+// neighbours.  An entry holds the token's text as is, capitalized,
+// doubled by a shadda, and both; NO_GLYPH marks a token the renderer
+// must work out for itself.
+
+struct glyph_t {
+  const char *	text[4];
+  unsigned char length[4];
+};
+
+enum glyph_variant_t {
+  GLYPH_PLAIN	  = 0,
+  GLYPH_CAPITAL	  = 1,
+  GLYPH_DOUBLED	  = 2
+};
+
+#define GLYPH4(plain, capital, doubled, both)			\
+  { { plain, capital, doubled, both },				\
+    { sizeof(plain) - 1, sizeof(capital) - 1,			\
+      sizeof(doubled) - 1, sizeof(both) - 1 } }
+
+#define GLYPH(text)  GLYPH4(text, text, text, text)
+#define NO_GLYPH     { { NULL, NULL, NULL, NULL }, { 0, 0, 0, 0 } }
+
+// Fails to compile unless `table' has an entry for every token
+#define CHECK_GLYPHS(table, count)				\
+  typedef char table##_complete[sizeof(table) / sizeof(table[0]) == \
+				(count) ? 1 : -1]
+
+inline unsigned int glyph_variant(const element_t& elem)
+{
+  return ((elem.flags & TF_CAPITALIZE) ? GLYPH_CAPITAL : 0) |
+         ((elem.flags & TF_SHADDA)     ? GLYPH_DOUBLED : 0);
+}
+
+inline bool output_glyph(const glyph_t * table, const element_t& elem,
+                         sink_t& out,
+                         unsigned int variant = GLYPH_PLAIN)
+{
+  const glyph_t& glyph(table[elem.token]);
+  if (! glyph.text[0])
+    return false;
+  out.write(glyph.text[variant], glyph.length[variant]);
+  return true;
+}
+
+static const glyph_t aasaan_glyphs[] = {
+  /* NONE          */ NO_GLYPH,
+  /* FIRST         */ NO_GLYPH,
+  /* ALIF          */ NO_GLYPH,
+  /* BIH           */ GLYPH("b"),
+  /* TIH           */ GLYPH("t"),
+  /* THIH          */ GLYPH("th"),
+  /* JIIM          */ GLYPH("j"),
+  /* HIH_HUTII     */ GLYPH(".h"),
+  /* KHIH          */ GLYPH("kh"),
+  /* SIIN          */ GLYPH("s"),
+  /* SHIIN         */ GLYPH("sh"),
+  /* DAAL          */ GLYPH("d"),
+  /* DHAAL         */ GLYPH("dh"),
+  /* RIH           */ GLYPH("r"),
+  /* ZIH           */ GLYPH("z"),
+  /* SAAD          */ GLYPH(".s"),
+  /* THAAD         */ GLYPH(".d"),
+  /* TAYN          */ GLYPH(".t"),
+  /* DTHAYN        */ GLYPH(".z"),
+  /* AYN           */ GLYPH("`"),
+  /* GHAYN         */ GLYPH("gh"),
+  /* FIH           */ GLYPH("f"),
+  /* QAAF          */ GLYPH("q"),
+  /* KAAF          */ GLYPH("k"),
+  /* LAAM          */ GLYPH("l"),
+  /* MIIM          */ GLYPH("m"),
+  /* NUUN          */ GLYPH("n"),
+  /* WAAW          */ NO_GLYPH,
+  /* YIH           */ NO_GLYPH,
+  /* ALIF_MAQSURA  */ GLYPH("Y"),
+  /* HIH           */ NO_GLYPH,
+  /* TIH_MARBUTA   */ GLYPH("T"),
+  /* HAMZA         */ GLYPH("'"),
+  /* PIH           */ GLYPH("p"),
+  /* CHIH          */ GLYPH("ch"),
+  /* ZHIH          */ GLYPH("zh"),
+  /* GAAF          */ GLYPH("g"),
+  /* LAST          */ NO_GLYPH,
+  /* PREFIX_AL     */ NO_GLYPH,
+  /* PREFIX_BI     */ GLYPH("bi-"),
+  /* PREFIX_LI     */ GLYPH("li-"),
+  /* PREFIX_WA     */ GLYPH("wa-"),
+  /* PREFIX_MII    */ GLYPH("mii-"),
+  /* SUFFIX_RAA    */ GLYPH("-raa"),
+  /* SUFFIX_HAA    */ GLYPH("-haa"),
+  /* SUFFIX_II     */ GLYPH("-ii"),
+  /* PERIOD        */ GLYPH("."),
+  /* COMMA         */ GLYPH(","),
+  /* SEMICOLON     */ GLYPH(";"),
+  /* COLON         */ GLYPH(":"),
+  /* EXCLAM        */ GLYPH("!"),
+  /* QUERY         */ GLYPH("?"),
+  /* SPACE         */ GLYPH(" "),
+  /* PARAGRAPH     */ NO_GLYPH,
+  /* LEFT_QUOTE    */ GLYPH("``"),
+  /* RIGHT_QUOTE   */ GLYPH("''"),
+  /* SPACER        */ GLYPH("-"),
+#ifdef MODE_STACK
+  /* PUSH_MODE     */ NO_GLYPH,
+  /* POP_MODE      */ NO_GLYPH,
+#endif
+  /* UNKNOWN       */ NO_GLYPH,
+};
+CHECK_GLYPHS(aasaan_glyphs, END);
+
+static const glyph_t arabtex_glyphs[] = {
+  /* NONE          */ NO_GLYPH,
+  /* FIRST         */ NO_GLYPH,
+  /* ALIF          */ NO_GLYPH,
+  /* BIH           */ GLYPH("b"),
+  /* TIH           */ GLYPH("t"),
+  /* THIH          */ GLYPH("_t"),
+  /* JIIM          */ GLYPH("^g"),
+  /* HIH_HUTII     */ GLYPH(".h"),
+  /* KHIH          */ GLYPH("_h"),
+  /* SIIN          */ GLYPH("s"),
+  /* SHIIN         */ GLYPH("^s"),
+  /* DAAL          */ GLYPH("d"),
+  /* DHAAL         */ GLYPH("_d"),
+  /* RIH           */ GLYPH("r"),
+  /* ZIH           */ GLYPH("z"),
+  /* SAAD          */ GLYPH(".s"),
+  /* THAAD         */ GLYPH(".d"),
+  /* TAYN          */ GLYPH(".t"),
+  /* DTHAYN        */ GLYPH(".z"),
+  /* AYN           */ GLYPH("`"),
+  /* GHAYN         */ GLYPH(".g"),
+  /* FIH           */ GLYPH("f"),
+  /* QAAF          */ GLYPH("q"),
+  /* KAAF          */ GLYPH("k"),
+  /* LAAM          */ GLYPH("l"),
+  /* MIIM          */ GLYPH("m"),
+  /* NUUN          */ GLYPH("n"),
+  /* WAAW          */ NO_GLYPH,
+  /* YIH           */ GLYPH("y"),
+  /* ALIF_MAQSURA  */ GLYPH("Y_a"),
+  /* HIH           */ NO_GLYPH,
+  /* TIH_MARBUTA   */ GLYPH("T"),
+  /* HAMZA         */ GLYPH("'"),
+  /* PIH           */ GLYPH("p"),
+  /* CHIH          */ GLYPH("^c"),
+  /* ZHIH          */ GLYPH("^z"),
+  /* GAAF          */ GLYPH("g"),
+  /* LAST          */ NO_GLYPH,
+  /* PREFIX_AL     */ GLYPH("al-"),
+  /* PREFIX_BI     */ GLYPH("bi-"),
+  /* PREFIX_LI     */ GLYPH("li-"),
+  /* PREFIX_WA     */ GLYPH("wa-"),
+  /* PREFIX_MII    */ GLYPH("mI\\hspace{0.4ex}"),
+  /* SUFFIX_RAA    */ GLYPH("\\hspace{0.4ex}raa"),
+  /* SUFFIX_HAA    */ GLYPH("-haa"),
+  /* SUFFIX_II     */ GLYPH("-I"),
+  /* PERIOD        */ GLYPH("."),
+  /* COMMA         */ GLYPH(","),
+  /* SEMICOLON     */ GLYPH(";"),
+  /* COLON         */ GLYPH(":"),
+  /* EXCLAM        */ GLYPH("!"),
+  /* QUERY         */ GLYPH("?"),
+  /* SPACE         */ GLYPH(" "),
+  /* PARAGRAPH     */ NO_GLYPH,
+  /* LEFT_QUOTE    */ GLYPH("\\lq "),
+  /* RIGHT_QUOTE   */ GLYPH("\\rq "),
+  /* SPACER        */ GLYPH("-"),
+#ifdef MODE_STACK
+  /* PUSH_MODE     */ NO_GLYPH,
+  /* POP_MODE      */ NO_GLYPH,
+#endif
+  /* UNKNOWN       */ NO_GLYPH,
+};
+CHECK_GLYPHS(arabtex_glyphs, END);
+
+// A renderer steps over the tokens one at a time.  It renders the
+// token at `letter', plus any it consumes along with it, and returns
+// how many that was.
+
+typedef std::size_t (*output_step_t)(context_t& ctx,
+                                     elements_t::iterator begin,
+                                     elements_t::iterator letter,
+                                     elements_t::iterator end,
+                                     sink_t& out);
+
+// Renderers whose output depends on the mode are instantiated once for
+// each, so the per-token code never tests it.  A run of tokens is
+// rendered by the instantiation for the mode in effect, until a
+// PUSH_MODE or POP_MODE changes it.
+
+template <mode_t M, output_step_t Step>
+inline elements_t::iterator output_run(context_t& ctx,
+                                       elements_t::iterator begin,
+                                       elements_t::iterator letter,
+                                       elements_t::iterator end,
+                                       sink_t& out)
+{
+  do
+    letter += (*Step)(ctx, begin, letter, end, out);
+  while (letter != end
+#ifdef MODE_STACK
+         && ctx.render.mode == M
+#endif
+         );
+  return letter;
+}
+
+template <output_step_t Arabic, output_step_t Persian>
+void output_modes(context_t& ctx, elements_t& in, sink_t& out)
+{
+  elements_t::iterator letter = in.begin();
+  while (letter != in.end()) {
+    if (ctx.render.mode == PERSIAN)
+      letter = output_run<PERSIAN, Persian>(ctx, in.begin(), letter,
+                                            in.end(), out);
+    else
+      letter = output_run<ARABIC, Arabic>(ctx, in.begin(), letter,
+                                          in.end(), out);
+  }
+}
+
+template <mode_t M>
+bool output_aasaan_letter(elements_t::iterator begin,
+                          elements_t::iterator letter,
+                          elements_t::iterator end,
+                          sink_t& out, bool quiet_shadda)
+{
+  if (! is_letter(*letter))
+    return false;
+
+  switch (letter->token) {
+  case ALIF:
+    if (letter->flags & TF_VOWEL)
+      out << 'a';
+    break;
+
+  case WAAW:
+    if (letter->flags & TF_DIPHTHONG) {
+      out << 'w';
+    }
+    else if (letter->flags & TF_CONSONANT) {
+      if (M == ARABIC)
+        out << 'w';
+      else
+        out << 'v';
+    }
+    else if (letter->flags & TF_VOWEL) {
+      if (letter->flags & TF_SILENT)
+        out << 'o';
+      else if (letter->flags & TF_SILENT_ALIF)
+        out << "UA";
+      else
+        out << 'u';
+    }
+    break;
+
+  case YIH:
+    if (letter->flags & (TF_CONSONANT | TF_DIPHTHONG))
+      out << 'y';
+    else if (letter->flags & TF_VOWEL) {
+      out << 'i';
+    }
+    break;
+
+  case HIH:
+    if (letter->flags & TF_SILENT || M == ARABIC) {
+      out << 'h';
+    } else {
+      elements_t::iterator next = letter; next++;
+
+      // The token before is only looked at if there is one
+      if (is_sukun(*letter) &&
+          (next == end || ! is_letter(*next)) &&
+          (letter == begin ||
+           ! ((letter - 1)->flags & (TF_VOWEL | TF_DIPHTHONG |
+                                     TF_DEFECTIVE_ALIF))))
+        {
+          out << 'H';
+        } else {
+        out << 'h';
+      }
+    }
+    break;
+
+  default:
+    output_glyph(aasaan_glyphs, *letter, out);
+    break;
+  }
+
+  if (letter->flags & TF_SHADDA && quiet_shadda)
     return true;
 
-  std::list<element_t>::iterator next = letter;
+  elements_t::iterator next = letter;
   next++;
 
   if (letter->flags & TF_FATHA) {
@@ -1070,327 +1962,153 @@ bool output_aasaan_letter(std::list<element_t>::iterator letter,
   return true;
 }
 
-void output_aasaan(std::list<element_t>& in, std::ostream& out,
-                   mode_t mode)
+template <mode_t M>
+std::size_t output_aasaan_step_in(context_t& ctx,
+                                  elements_t::iterator begin,
+                                  elements_t::iterator letter,
+                                  elements_t::iterator end, sink_t& out)
 {
-  std::list<element_t>::iterator letter = in.begin();
-
-  while (letter != in.end()) {
-    if (letter->flags & TF_CAPITALIZE)
-      out << '^';
-    if (letter->token == AYN && letter->flags & TF_SHADDA) {
-      out << '~';
-      output_aasaan_letter(letter, in.end(), out, mode, false);
-    }
-    else if (output_aasaan_letter(letter, in.end(), out, mode, true)) {
-      if (letter->flags & TF_SHADDA)
-        output_aasaan_letter(letter, in.end(), out, mode, false);
-    }
-    else {
-      switch (letter->token) {
-      case PREFIX_AL:
-        if (! (letter->flags & TF_SUN_LETTER)) {
-          out << "al-";
-          break;
-        }
-        letter++;
-
-        out << 'a';
-        output_aasaan_letter(letter, in.end(), out, mode, true);
-        out << '-';
-
-        // when laam is sun, it must be output: al-ll
-        if (letter->token == LAAM)
-          output_aasaan_letter(letter, in.end(), out, mode, true);
-        output_aasaan_letter(letter, in.end(), out, mode, false);
-
-        break;
-
-      case PREFIX_BI:
-        out << "bi-";
-        break;
-
-      case PREFIX_LI:
-        out << "li-";
-        break;
-
-      case PREFIX_WA:
-        out << "wa-";
-        break;
-
-      case PREFIX_MII:
-        out << "mii-";
-        break;
-
-      case SUFFIX_RAA:
-        out << "-raa";
-        break;
-
-      case SUFFIX_HAA:
-        out << "-haa";
-        break;
-
-      case SUFFIX_II:
-        out << "-ii";
-        break;
-
-
-      case SPACE:
-        out << ' ';
-        break;
-
-      case PERIOD:
-        out << '.';
-        break;
-
-      case COMMA:
-        out << ',';
-        break;
-
-      case SEMICOLON:
-        out << ';';
-        break;
-
-      case COLON:
-        out << ':';
-        break;
-
-      case EXCLAM:
-        out << '!';
-        break;
-
-      case QUERY:
-        out << '?';
-        break;
+#ifndef MODE_STACK
+  (void) ctx;
+#endif
+  elements_t::iterator start = letter;
 
-      case PARAGRAPH:
-        out << std::endl
-            << std::endl;
+  if (letter->flags & TF_CAPITALIZE)
+    out << '^';
+  if (letter->token == AYN && letter->flags & TF_SHADDA) {
+    out << '~';
+    output_aasaan_letter<M>(begin, letter, end, out, false);
+  }
+  else if (output_aasaan_letter<M>(begin, letter, end, out, true)) {
+    if (letter->flags & TF_SHADDA)
+      output_aasaan_letter<M>(begin, letter, end, out, false);
+  }
+  else {
+    switch (letter->token) {
+    case PREFIX_AL:
+      if (! (letter->flags & TF_SUN_LETTER)) {
+        out << "al-";
         break;
+      }
+      letter++;
 
+      out << 'a';
+      output_aasaan_letter<M>(begin, letter, end, out, true);
+      out << '-';
 
-      case SPACER:
-        out << '-';
-        break;
-
+      // when laam is sun, it must be output: al-ll
+      if (letter->token == LAAM)
+        output_aasaan_letter<M>(begin, letter, end, out, true);
+      output_aasaan_letter<M>(begin, letter, end, out, false);
 
-      case LEFT_QUOTE:
-        out << "``";
-        break;
+      break;
 
-      case RIGHT_QUOTE:
-        out << "''";
-        break;
+    case PARAGRAPH:
+      out << '\n'
+          << '\n';
+      break;
 
 
 #ifdef MODE_STACK
-      case PUSH_MODE:
-        if (letter->flags == (unsigned long) ARABIC) {
-          mode = ARABIC;
-          out << "A/";
-        }
-        else if (letter->flags == (unsigned long) PERSIAN) {
-          mode = PERSIAN;
-          out << "P/";
-        }
-        break;
+    case PUSH_MODE:
+      if (letter->flags == (unsigned long) ARABIC) {
+        ctx.render.mode = ARABIC;
+        out << "A/";
+      }
+      else if (letter->flags == (unsigned long) PERSIAN) {
+        ctx.render.mode = PERSIAN;
+        out << "P/";
+      }
+      break;
 
-      case POP_MODE:
-        if (mode == ARABIC)
-          out << "/A";
-        else if (mode == PERSIAN)
-          out << "/P";
+    case POP_MODE:
+      if (M == ARABIC)
+        out << "/A";
+      else
+        out << "/P";
 
-        mode = (mode_t) letter->flags;
-        break;
+      ctx.render.mode = mode_of(*letter);
+      break;
 #endif // MODE_STACK
 
 
-      case UNKNOWN:
-        out << (char)letter->flags;
-        break;
+    case UNKNOWN:
+      out << (char)letter->flags;
+      break;
 
-      default:
+    default:
+      if (! output_glyph(aasaan_glyphs, *letter, out))
         std::cerr << "output_aasaan: unhandled token "
                   << letter->token << std::endl;
-        break;
-      }
+      break;
     }
-
-    letter++;
   }
+
+  letter++;
+
+  return letter - start;
+}
+
+std::size_t output_aasaan_step(context_t& ctx, elements_t::iterator begin,
+                               elements_t::iterator letter,
+                               elements_t::iterator end, sink_t& out)
+{
+  if (ctx.render.mode == PERSIAN)
+    return output_aasaan_step_in<PERSIAN>(ctx, begin, letter, end, out);
+  return output_aasaan_step_in<ARABIC>(ctx, begin, letter, end, out);
 }
 
-bool output_arabtex_letter(std::list<element_t>::iterator letter,
-                           std::list<element_t>::iterator end,
-                           std::ostream& out, mode_t mode,
+void output_aasaan(context_t& ctx, elements_t& in, sink_t& out,
+                   mode_t mode)
+{
+  ctx.render.reset(mode);
+  output_modes<output_aasaan_step_in<ARABIC>,
+               output_aasaan_step_in<PERSIAN> >(ctx, in, out);
+}
+
+bool output_arabtex_letter(elements_t::iterator letter,
+                           elements_t::iterator end,
+                           sink_t& out, mode_t,
                            bool quiet_shadda)
 {
+  if (! is_letter(*letter))
+    return false;
+
   switch (letter->token) {
   case ALIF:
     if (letter->flags & TF_VOWEL)
       out << 'a';
     break;
 
-  case BIH:
-    out << 'b';
-    break;
-
-  case TIH:
-    out << 't';
-    break;
-
-  case THIH:
-    out << "_t";
+  case WAAW:
+    // If this waaw is followed by a silent alif, then the
+    // encoding has already been done during the handling of the
+    // preceding letter's DHAMMA, below
+        
+    if (! (letter->flags & TF_SILENT_ALIF))
+      out << 'w';
     break;
 
-  case JIIM:
-    out << "^g";
+  case HIH:
+    if (letter->flags & TF_SILENT)
+      out << 'H';
+    else
+      out << 'h';
     break;
 
-  case HIH_HUTII:
-    out << ".h";
+  default:
+    output_glyph(arabtex_glyphs, *letter, out);
     break;
+  }
 
-  case KHIH:
-    out << "_h";
-    break;
+  if (letter->flags & TF_SHADDA && quiet_shadda)
+    return true;
 
-  case SIIN:
-    out << 's';
-    break;
+  elements_t::iterator next = letter;
+  next++;
 
-  case SHIIN:
-    out << "^s";
-    break;
-
-  case DAAL:
-    out << 'd';
-    break;
-
-  case DHAAL:
-    out << "_d";
-    break;
-
-  case RIH:
-    out << 'r';
-    break;
-
-  case ZIH:
-    out << 'z';
-    break;
-
-  case SAAD:
-    out << ".s";
-    break;
-
-  case THAAD:
-    out << ".d";
-    break;
-
-  case TAYN:
-    out << ".t";
-    break;
-
-  case DTHAYN:
-    out << ".z";
-    break;
-
-  case AYN:
-    out << '`';
-    break;
-
-  case GHAYN:
-    out << ".g";
-    break;
-
-  case FIH:
-    out << 'f';
-    break;
-
-  case QAAF:
-    out << 'q';
-    break;
-
-  case KAAF:
-    out << 'k';
-    break;
-
-  case LAAM:
-    out << 'l';
-    break;
-
-  case MIIM:
-    out << 'm';
-    break;
-
-  case NUUN:
-    out << 'n';
-    break;
-
-  case WAAW:
-    // If this waaw is followed by a silent alif, then the
-    // encoding has already been done during the handling of the
-    // preceding letter's DHAMMA, below
-        
-    if (! (letter->flags & TF_SILENT_ALIF))
-      out << 'w';
-    break;
-
-  case YIH:
-    out << 'y';
-    break;
-
-  case ALIF_MAQSURA:
-    out << "Y_a";
-    break;
-
-  case HIH:
-    if (letter->flags & TF_SILENT)
-      out << 'H';
-    else
-      out << 'h';
-    break;
-
-  case TIH_MARBUTA:
-    out << 'T';
-    break;
-
-  case HAMZA:
-    out << '\'';
-    break;
-
-
-  // Persian letters
-
-  case PIH:
-    out << 'p';
-    break;
-
-  case CHIH:
-    out << "^c";
-    break;
-
-  case ZHIH:
-    out << "^z";
-    break;
-
-  case GAAF:
-    out << 'g';
-    break;
-
-  default:
-    return false;
-  }
-
-  if (letter->flags & TF_SHADDA && quiet_shadda)
-    return true;
-
-  std::list<element_t>::iterator next = letter;
-  next++;
-
-  if (letter->flags & TF_TANWEEN)
-    out << '"';
+  if (letter->flags & TF_TANWEEN)
+    out << '"';
 
   if (letter->flags & TF_FATHA) {
     out << 'a';
@@ -1404,7 +2122,7 @@ bool output_arabtex_letter(std::list<element_t>::iterator letter,
   else if (letter->flags & TF_DHAMMA) {
     if (next != end && next->flags & TF_DIPHTHONG)
       out << 'o';
-    else if (next->flags & TF_SILENT_ALIF)
+    else if (next != end && next->flags & TF_SILENT_ALIF)
       out << "UA";
     else
       out << 'u';
@@ -1425,130 +2143,179 @@ bool output_arabtex_letter(std::list<element_t>::iterator letter,
   return true;
 }
 
-void output_arabtex(std::list<element_t>& in, std::ostream& out, mode_t mode)
+std::size_t output_arabtex_step(context_t& ctx, elements_t::iterator,
+                                elements_t::iterator letter,
+                                elements_t::iterator end, sink_t& out)
 {
-  std::list<element_t>::iterator letter = in.begin();
-
-  while (letter != in.end()) {
-    if (output_arabtex_letter(letter, in.end(), out, mode, true)) {
-      if (letter->flags & TF_SHADDA)
-        output_arabtex_letter(letter, in.end(), out, mode, false);
-    }
-    else {
-      switch (letter->token) {
-      case PREFIX_AL:
-        out << "al-";
-        break;
-
-      case PREFIX_BI:
-        out << "bi-";
-        break;
-
-      case PREFIX_LI:
-        out << "li-";
-        break;
-
-      case PREFIX_WA:
-        out << "wa-";
-        break;
-
-      case PREFIX_MII:
-        out << "mI\\hspace{0.4ex}";
-        break;
-
-      case SUFFIX_RAA:
-        out << "\\hspace{0.4ex}raa";
-        break;
-
-      case SUFFIX_HAA:
-        out << "-haa";
-        break;
-
-      case SUFFIX_II:
-        out << "-I";
-        break;
-
-
-      case SPACE:
-        out << ' ';
-        break;
-
-      case PERIOD:
-        out << '.';
-        break;
-
-      case COMMA:
-        out << ',';
-        break;
-
-      case SEMICOLON:
-        out << ';';
-        break;
-
-      case COLON:
-        out << ':';
-        break;
+  elements_t::iterator start = letter;
+  mode_t&	       mode(ctx.render.mode);
 
-      case EXCLAM:
-        out << '!';
-        break;
-
-      case QUERY:
-        out << '?';
-        break;
+  if (output_arabtex_letter(letter, end, out, mode, true)) {
+    if (letter->flags & TF_SHADDA)
+      output_arabtex_letter(letter, end, out, mode, false);
+  }
+  else {
+    switch (letter->token) {
+    case PARAGRAPH:
+      out << '\n' << '\n';
+      break;
 
-      case PARAGRAPH:
-        out << std::endl << std::endl;
-        break;
 
+#ifdef MODE_STACK
+    case PUSH_MODE:
+    case POP_MODE:
+      if (letter->flags == (unsigned long) ARABIC)
+        out << "\\setarab \\newtanwin";
+      else if (letter->flags == (unsigned long) PERSIAN)
+        out << "\\setfarsi \\newtanwin";
+      break;
+#endif // MODE_STACK
 
-      case SPACER:
-        out << '-';
-        break;
 
+    case UNKNOWN:
+      out << (char)letter->flags;
+      break;
 
-      case LEFT_QUOTE:
-        out << "\\lq ";
-        break;
+    default:
+      if (! output_glyph(arabtex_glyphs, *letter, out))
+        std::cerr << "output_arabtex: unhandled token "
+                  << letter->token << std::endl;
+      break;
+    }
+  }
 
-      case RIGHT_QUOTE:
-        out << "\\rq ";
-        break;
+  letter++;
 
+  return letter - start;
+}
 
-#ifdef MODE_STACK
-      case PUSH_MODE:
-      case POP_MODE:
-        if (letter->flags == (unsigned long) ARABIC)
-          out << "\\setarab \\newtanwin";
-        else if (letter->flags == (unsigned long) PERSIAN)
-          out << "\\setfarsi \\newtanwin";
-        break;
-#endif // MODE_STACK
+void output_arabtex(context_t& ctx, elements_t& in, sink_t& out,
+                    mode_t mode)
+{
+  ctx.render.reset(mode);
 
+  elements_t::iterator letter = in.begin();
+  while (letter != in.end())
+    letter += output_arabtex_step(ctx, in.begin(), letter, in.end(), out);
+}
 
-      case UNKNOWN:
-        out << (char)letter->flags;
-        break;
+// The characters output_unicode writes, either as HTML numeric
+// character references or as UTF-8.  Nearly all of them fall in the
+// Arabic block at U+0600, for which both forms are built once up
+// front; the odd space or quotation mark is encoded as it comes.
 
-      default:
-        std::cerr << "output_arabtex: unhandled token "
-                  << letter->token << std::endl;
-        break;
-      }
+class unicode_table_t
+{
+  enum { FIRST_CHAR = 0x0600, CHARS = 0x100 };
+
+  char entities[CHARS][8];	// "&#1576;"
+  char utf8[CHARS][2];
+
+public:
+  unicode_table_t() {
+    for (unsigned int i = 0; i < CHARS; i++) {
+      unsigned int code = FIRST_CHAR + i;
+      std::sprintf(entities[i], "&#%u;", code);
+      utf8[i][0] = char(0xc0 | (code >> 6));
+      utf8[i][1] = char(0x80 | (code & 0x3f));
     }
+  }
 
-    letter++;
+  void output(sink_t& out, bool as_utf8, unsigned int code) const {
+    if (code - FIRST_CHAR < CHARS) {
+      if (as_utf8)
+        out.write(utf8[code - FIRST_CHAR], 2);
+      else
+        out.write(entities[code - FIRST_CHAR], 7);
+    }
+    else if (! as_utf8) {
+      out << "&#" << code << ';';
+    }
+    else if (code < 0x80) {
+      out << char(code);
+    }
+    else if (code < 0x800) {
+      out << char(0xc0 | (code >> 6))
+          << char(0x80 | (code & 0x3f));
+    }
+    else {
+      out << char(0xe0 | (code >> 12))
+          << char(0x80 | ((code >> 6) & 0x3f))
+          << char(0x80 | (code & 0x3f));
+    }
   }
+};
+
+static const unicode_table_t unicode_table;
+
+// The code point of each letter that is written the same way wherever
+// it appears, or zero.
+
+static const unsigned short unicode_letters[] = {
+  0,    // NONE
+  0,    // FIRST
+  0,    // ALIF
+  1576, // BIH
+  1578, // TIH
+  1579, // THIH
+  1580, // JIIM
+  1581, // HIH_HUTII
+  1582, // KHIH
+  1587, // SIIN
+  1588, // SHIIN
+  1583, // DAAL
+  1584, // DHAAL
+  1585, // RIH
+  1586, // ZIH
+  1589, // SAAD
+  1590, // THAAD
+  1591, // TAYN
+  1592, // DTHAYN
+  1593, // AYN
+  1594, // GHAYN
+  1601, // FIH
+  1602, // QAAF
+  1705, // KAAF
+  1604, // LAAM
+  1605, // MIIM
+  1606, // NUUN
+  1608, // WAAW
+  0,    // YIH
+  0,    // ALIF_MAQSURA
+  0,    // HIH
+  1577, // TIH_MARBUTA
+  0,    // HAMZA
+  1662, // PIH
+  1670, // CHIH
+  1688, // ZHIH
+  1711, // GAAF
+  0,    // LAST
+};
+CHECK_GLYPHS(unicode_letters, LAST + 1);
+
+static inline void output_chars(sink_t& out, bool utf8,
+                                unsigned int a, unsigned int b = 0,
+                                unsigned int c = 0, unsigned int d = 0)
+{
+  unicode_table.output(out, utf8, a);
+  if (b)
+    unicode_table.output(out, utf8, b);
+  if (c)
+    unicode_table.output(out, utf8, c);
+  if (d)
+    unicode_table.output(out, utf8, d);
 }
 
-bool output_unicode_letter(std::list<element_t>::iterator last,
-			   std::list<element_t>::iterator letter,
-                           std::list<element_t>::iterator end,
-                           std::ostream& out, mode_t mode,
-                           bool quiet_shadda)
+template <mode_t M, bool UTF8>
+bool output_unicode_letter(const render_state_t& state,
+			   elements_t::iterator letter,
+                           elements_t::iterator end,
+                           sink_t& out, bool quiet_shadda)
 {
-  std::list<element_t>::iterator next = letter;
+  const element_t& last(state.last);
+  const bool	   utf8(UTF8);
+
+  elements_t::iterator next = letter;
   next++;
 
   // 1. Hamza rules need to be worked out.
@@ -1558,233 +2325,117 @@ bool output_unicode_letter(std::list<element_t>::iterator last,
   switch (letter->token) {
   case ALIF:
     if (letter->flags & TF_BAA_KULAA)
-      out << "&#1570;";
+      output_chars(out, utf8, 1570);
     else
-      out << "&#1575;";
+      output_chars(out, utf8, 1575);
     wrote_alif = true;
     break;
 
-  case BIH:
-    out << "&#1576;";
-    break;
-
-  case TIH:
-    out << "&#1578;";
-    break;
-
-  case THIH:
-    out << "&#1579;";
-    break;
-
-  case JIIM:
-    out << "&#1580;";
-    break;
-
-  case HIH_HUTII:
-    out << "&#1581;";
-    break;
-
-  case KHIH:
-    out << "&#1582;";
-    break;
-
-  case SIIN:
-    out << "&#1587;";
-    break;
-
-  case SHIIN:
-    out << "&#1588;";
-    break;
-
-  case DAAL:
-    out << "&#1583;";
-    break;
-
-  case DHAAL:
-    out << "&#1584;";
-    break;
-
-  case RIH:
-    out << "&#1585;";
-    break;
-
-  case ZIH:
-    out << "&#1586;";
-    break;
-
-  case SAAD:
-    out << "&#1589;";
-    break;
-
-  case THAAD:
-    out << "&#1590;";
-    break;
-
-  case TAYN:
-    out << "&#1591;";
-    break;
-
-  case DTHAYN:
-    out << "&#1592;";
-    break;
-
-  case AYN:
-    out << "&#1593;";
-    break;
-
-  case GHAYN:
-    out << "&#1594;";
-    break;
-
-  case FIH:
-    out << "&#1601;";
-    break;
-
-  case QAAF:
-    out << "&#1602;";
-    break;
-
-  case KAAF:
-    out << "&#1705;";
-    break;
-
-  case LAAM:
-    out << "&#1604;";
-    break;
-
-  case MIIM:
-    out << "&#1605;";
-    break;
-
-  case NUUN:
-    out << "&#1606;";
-    break;
-
-  case WAAW:
-    out << "&#1608;";
-    break;
-
   case YIH:
     if (letter->flags & TF_IZAAFIH)
-      out << "&#1574;";
-    else if (mode == PERSIAN &&
+      output_chars(out, utf8, 1574);
+    else if (M == PERSIAN &&
 	(next == end || next->token == SPACE ||
 	 next->token == PERIOD || next->token == COMMA ||
 	 next->token == RIGHT_QUOTE || next->token == SUFFIX_RAA ||
 	 next->token == SUFFIX_HAA))
-      out << "&#1740;";
-    else if (mode == PERSIAN && next->token == SUFFIX_II)
-      out << "&#1610;&#1740";
+      output_chars(out, utf8, 1740);
+    else if (M == PERSIAN && next != end && next->token == SUFFIX_II)
+      output_chars(out, utf8, 1610, 1740);
     else
-      out << "&#1610;";
+      output_chars(out, utf8, 1610);
     break;
 
   case ALIF_MAQSURA:
-    out << "&#1609;&#1648;";
+    output_chars(out, utf8, 1609, 1648);
     break;
 
   case HIH:
     if (letter->flags & TF_IZAAFIH && letter->flags & TF_SILENT) {
-      out << "&#1728;";
-    } else if (next->token == SUFFIX_II && letter->flags & TF_SILENT) {
-      out << "&#1607;";
-      out << "&#8239;";  // narrow no-break space
-      out << "&#1575;";
+      output_chars(out, utf8, 1728);
+    } else if (next != end && next->token == SUFFIX_II &&
+               letter->flags & TF_SILENT) {
+      output_chars(out, utf8, 1607);
+      output_chars(out, utf8, 8239);  // narrow no-break space
+      output_chars(out, utf8, 1575);
       wrote_alif = true;
     } else {
-      out << "&#1607;";
+      output_chars(out, utf8, 1607);
     }
     break;
 
-  case TIH_MARBUTA:
-    out << "&#1577;";
-    break;
-
   case HAMZA:
-    if (last == end || last->token == SPACE || last->token == LEFT_QUOTE) {
+    if (last.token == NONE || last.token == SPACE || last.token == LEFT_QUOTE) {
       if (letter->flags & TF_KASRA)
-	out << "&#1573;";
+	output_chars(out, utf8, 1573);
       else
-	out << "&#1571;";
+	output_chars(out, utf8, 1571);
     }
-    else if (last != end && ! (last->flags & TF_DIPHTHONG) &&
-	     (last->flags & TF_KASRA || letter->flags & TF_KASRA)) {
-      out << "&#1574;";
+    else if (last.token != NONE && ! (last.flags & TF_DIPHTHONG) &&
+	     (last.flags & TF_KASRA || letter->flags & TF_KASRA)) {
+      output_chars(out, utf8, 1574);
     }
-    else if (last != end && ! (last->flags & (TF_VOWEL | TF_DIPHTHONG)) &&
-	     (last->flags & TF_DHAMMA || letter->flags & TF_DHAMMA)) {
-      out << "&#1572;";
+    else if (last.token != NONE && ! (last.flags & (TF_VOWEL | TF_DIPHTHONG)) &&
+	     (last.flags & TF_DHAMMA || letter->flags & TF_DHAMMA)) {
+      output_chars(out, utf8, 1572);
     }
-    else if (last != end && ! (last->flags & TF_VOWEL) &&
-	     (last->flags & TF_FATHA || letter->flags & TF_FATHA)) {
-      out << "&#1571;";
+    else if (last.token != NONE && ! (last.flags & TF_VOWEL) &&
+	     (last.flags & TF_FATHA || letter->flags & TF_FATHA)) {
+      output_chars(out, utf8, 1571);
       wrote_alif = true;
     }
     else {
-      out << "&#1569;";
+      output_chars(out, utf8, 1569);
     }
     break;
 
-  // Persian letters
-  case PIH:
-    out << "&#1662;";
-    break;
-
-  case CHIH:
-    out << "&#1670;";
-    break;
-
-  case ZHIH:
-    out << "&#1688;";
-    break;
-
-  case GAAF:
-    out << "&#1711;";
-    break;
-
   default:
-    return false;
+    if (! is_letter(*letter) || ! unicode_letters[letter->token])
+      return false;
+    output_chars(out, utf8, unicode_letters[letter->token]);
+    break;
   }
 
   if (letter->flags & TF_TANWEEN) {
     if (letter->flags & TF_FATHA) {
       if (! wrote_alif)
-	out << "&#1575;";
-      out << "&#1611;";
+	output_chars(out, utf8, 1575);
+      output_chars(out, utf8, 1611);
     }
     else if (letter->flags & TF_KASRA) {
-      out << "&#1613;";
+      output_chars(out, utf8, 1613);
     }
     else if (letter->flags & TF_DHAMMA) {
-      out << "&#1612;";
+      output_chars(out, utf8, 1612);
     }
-  } else if (mode == ARABIC || next == end || ! (next->flags & TF_VOWEL)) {
-    if ((mode == ARABIC && next != end &&
+  } else if (M == ARABIC || next == end || ! (next->flags & TF_VOWEL)) {
+    if ((M == ARABIC && next != end &&
 	 next->flags & TF_VOWEL && next->token == ALIF) ||
 	letter->flags & TF_FATHA)
-      out << "&#1614;";
-    else if ((mode == ARABIC && next != end &&
+      output_chars(out, utf8, 1614);
+    else if ((M == ARABIC && next != end &&
 	      next->flags & TF_VOWEL && next->token == YIH) ||
 	     letter->flags & TF_KASRA)
-      out << "&#1616;";
-    else if ((mode == ARABIC && next != end &&
+      output_chars(out, utf8, 1616);
+    else if ((M == ARABIC && next != end &&
 	      next->flags & TF_VOWEL && next->token == WAAW) ||
 	     letter->flags & TF_DHAMMA)
-      out << "&#1615;";
-    else if (mode == ARABIC &&
-	     ! (letter->flags & TF_VOWEL) && ! (next->flags & TF_VOWEL) &&
+      output_chars(out, utf8, 1615);
+    else if (M == ARABIC &&
+	     ! (letter->flags & TF_VOWEL) &&
+	     (next == end || ! (next->flags & TF_VOWEL)) &&
 	     ! (letter->flags & TF_DEFECTIVE_ALIF))
-      out << "&#1618;";
+      output_chars(out, utf8, 1618);
   }
 
   if (letter->flags & TF_DEFECTIVE_ALIF)
-      out << "&#1648;";
+      output_chars(out, utf8, 1648);
 
   if (letter->flags & TF_IZAAFIH) {
     if (letter->flags & TF_VOWEL && letter->token != YIH) {
-      out << "&#1740;&#1616;";
+      output_chars(out, utf8, 1740, 1616);
     } else {
-      out << "&#1616;";
+      output_chars(out, utf8, 1616);
     }
   }
   
@@ -1794,147 +2445,200 @@ bool output_unicode_letter(std::list<element_t>::iterator last,
   return true;
 }
 
-void output_unicode(std::list<element_t>& in, std::ostream& out,
-                    mode_t mode)
+template <mode_t M, bool UTF8>
+std::size_t output_unicode_step_in(context_t& ctx,
+                                   elements_t::iterator,
+                                   elements_t::iterator letter,
+                                   elements_t::iterator end, sink_t& out)
 {
-  std::list<element_t>::iterator letter = in.begin();
-  std::list<element_t>::iterator last = in.end();
-  std::list<element_t>::iterator last_letter = in.end();
+  elements_t::iterator start = letter;
+  element_t&	       last(ctx.render.last);
+  element_t&	       last_letter(ctx.render.last_letter);
+  const bool	       utf8(UTF8);
+
+  if (output_unicode_letter<M, UTF8>(ctx.render, letter, end, out, true)) {
+    if (letter->flags & TF_SHADDA)
+      output_chars(out, utf8, 1617);
+  } else {
+    switch (letter->token) {
+    case PREFIX_AL:
+      if (last_letter.token != NONE &&
+	  last_letter.flags & (TF_FATHA | TF_KASRA | TF_DHAMMA))
+	output_chars(out, utf8, 1649, 1604, 1618);
+      else
+	output_chars(out, utf8, 1571, 1614, 1604, 1618);
+      break;
 
-  while (letter != in.end()) {
-    if (output_unicode_letter(last, letter, in.end(), out, mode, true)) {
-      if (letter->flags & TF_SHADDA)
-        out << "&#1617;";
-    } else {
-      switch (letter->token) {
-      case PREFIX_AL:
-	if (last_letter != in.end() &&
-	    last_letter->flags & (TF_FATHA | TF_KASRA | TF_DHAMMA))
-	  out << "&#1649;&#1604;&#1618;";
-	else
-	  out << "&#1571;&#1614;&#1604;&#1618;";
-        break;
+    case PREFIX_BI:
+      output_chars(out, utf8, 1576, 1616);
+      break;
 
-      case PREFIX_BI:
-        out << "&#1576;&#1616;";
-        break;
+    case PREFIX_LI:
+      output_chars(out, utf8, 1604, 1616);
+      break;
 
-      case PREFIX_LI:
-        out << "&#1604;&#1616;";
-        break;
+    case PREFIX_WA:
+      output_chars(out, utf8, 1608, 1614);
+      break;
 
-      case PREFIX_WA:
-        out << "&#1608;&#1614;";
-        break;
+    case PREFIX_MII:
+      output_chars(out, utf8, 1605, 1610, 8239);
+      break;
 
-      case PREFIX_MII:
-        out << "&#1605;&#1610;&#8239;";
-        break;
+    case SUFFIX_RAA:
+      output_chars(out, utf8, 8201, 1585, 1575);
+      break;
 
-      case SUFFIX_RAA:
-        out << "&#8201;&#1585;&#1575;";
-        break;
+    case SUFFIX_HAA:
+      output_chars(out, utf8, 1607, 1575);
+      break;
 
-      case SUFFIX_HAA:
-        out << "&#1607;&#1575;";
-        break;
+    case SUFFIX_II:
+      if (M == PERSIAN)
+	output_chars(out, utf8, 1740);
+      else
+	output_chars(out, utf8, 1610);
+      break;
 
-      case SUFFIX_II:
-	if (mode == PERSIAN)
-	  out << "&#1740;";
-	else
-	  out << "&#1610;";
-        break;
-
-      case SPACE: {
-	std::list<element_t>::iterator next = letter;
-	next++;
-	if (! (next == in.end() || next->token == POP_MODE))
-	  out << ' ';
-        break;
-      }
+    case SPACE: {
+      elements_t::iterator next = letter;
+      next++;
+#ifdef MODE_STACK
+      if (next != end && next->token == POP_MODE)
+	break;
+#endif
+      if (next != end)
+	out << ' ';
+      break;
+    }
 
-      case PERIOD:
-        out << '.';
-        break;
+    case PERIOD:
+      out << '.';
+      break;
 
-      case COMMA:
-        out << ',';
-        break;
+    case COMMA:
+      out << ',';
+      break;
 
-      case SEMICOLON:
-        out << '؛';
-        break;
+    case SEMICOLON:
+      output_chars(out, utf8, 1563);
+      break;
 
-      case COLON:
-        out << ':';
-        break;
+    case COLON:
+      out << ':';
+      break;
 
-      case EXCLAM:
-        out << '!';
-        break;
+    case EXCLAM:
+      out << '!';
+      break;
 
-      case QUERY:
-        out << '؟';
-        break;
+    case QUERY:
+      output_chars(out, utf8, 1567);
+      break;
 
-      case PARAGRAPH:
-        out << std::endl << std::endl;
-        break;
+    case PARAGRAPH:
+      out << '\n' << '\n';
+      break;
 
-      case SPACER:
-        //out << "&#8201;";  // thin space
-        out << "&#8239;";  // narrow no-break space
-        break;
+    case SPACER:
+      //output_chars(out, utf8, 8201);  // thin space
+      output_chars(out, utf8, 8239);  // narrow no-break space
+      break;
 
-      case LEFT_QUOTE:
-        out << "&#171;&#8201;";
-        break;
-      case RIGHT_QUOTE:
-        out << "&#8201;&#187;";
-        break;
+    case LEFT_QUOTE:
+      output_chars(out, utf8, 171, 8201);
+      break;
+    case RIGHT_QUOTE:
+      output_chars(out, utf8, 8201, 187);
+      break;
 
 #ifdef MODE_STACK
-      case PUSH_MODE:
-	mode_stack.push_front(mode);
-	mode = (mode_t)letter->flags;
-	break;
-      case POP_MODE:
-	mode = mode_stack.front();
-	mode_stack.pop_front();
-	break;
+    case PUSH_MODE:
+      ctx.render.modes.push_back(M);
+      ctx.render.mode = mode_of(*letter);
+      break;
+    case POP_MODE:
+      if (! ctx.render.modes.empty()) {
+	ctx.render.mode = ctx.render.modes.back();
+	ctx.render.modes.pop_back();
+      } else {
+	ctx.render.mode = mode_of(*letter);
+      }
+      break;
 #endif // MODE_STACK
 
-      case UNKNOWN:
-        out << (char)letter->flags;
-        break;
+    case UNKNOWN:
+      out << (char)letter->flags;
+      break;
 
-      default:
-        std::cerr << "output_unicode: unhandled token "
-                  << letter->token << std::endl;
-        break;
-      }
+    default:
+      std::cerr << "output_unicode: unhandled token "
+                << letter->token << std::endl;
+      break;
     }
+  }
+
+  last = *letter;
+  if (is_letter(*letter))
+    last_letter = *letter;
 
-    last = letter;
-    if (is_letter(*letter))
-      last_letter = letter;
+  letter++;
 
+#ifdef MODE_STACK
+  if (last.token == PUSH_MODE && letter != end && letter->token == SPACE)
     letter++;
+#endif
 
-    if (last->token == PUSH_MODE && letter != in.end() && letter->token == SPACE)
-      letter++;
-  }
+  return letter - start;
+}
+
+// The same, but writing UTF-8 rather than numeric character references
+
+std::size_t output_utf8_step(context_t& ctx, elements_t::iterator begin,
+                             elements_t::iterator letter,
+                             elements_t::iterator end, sink_t& out)
+{
+  if (ctx.render.mode == PERSIAN)
+    return output_unicode_step_in<PERSIAN, true>(ctx, begin, letter, end,
+                                                 out);
+  return output_unicode_step_in<ARABIC, true>(ctx, begin, letter, end, out);
+}
+
+std::size_t output_unicode_step(context_t& ctx, elements_t::iterator begin,
+                                elements_t::iterator letter,
+                                elements_t::iterator end, sink_t& out)
+{
+  if (ctx.render.mode == PERSIAN)
+    return output_unicode_step_in<PERSIAN, false>(ctx, begin, letter, end,
+                                                  out);
+  return output_unicode_step_in<ARABIC, false>(ctx, begin, letter, end,
+                                               out);
+}
+
+void output_unicode(context_t& ctx, elements_t& in, sink_t& out,
+                    mode_t mode)
+{
+  ctx.render.reset(mode);
+  output_modes<output_unicode_step_in<ARABIC, false>,
+               output_unicode_step_in<PERSIAN, false> >(ctx, in, out);
+}
+
+void output_utf8(context_t& ctx, elements_t& in, sink_t& out,
+                 mode_t mode)
+{
+  ctx.render.reset(mode);
+  output_modes<output_unicode_step_in<ARABIC, true>,
+               output_unicode_step_in<PERSIAN, true> >(ctx, in, out);
 }
 
-static inline void output_string(std::list<element_t>::iterator letter,
-                                 std::ostream& out, const std::string& str,
+static inline void output_string(elements_t::iterator letter,
+                                 sink_t& out, const std::string& str,
                                  bool maybe_add_shadda = false)
 {
   const char *ptr = str.c_str();
 
   if (letter->flags & TF_CAPITALIZE)
-    out << char(toupper(*ptr)) << ptr + 1;
+    out << char(toupper((unsigned char) *ptr)) << ptr + 1;
   else
     out << ptr;
 
@@ -1942,8 +2646,8 @@ static inline void output_string(std::list<element_t>::iterator letter,
     output_string(letter, out, str, false);
 }
 
-static inline void output_initial_string(std::list<element_t>::iterator letter,
-                                         std::ostream& out, const std::string& str)
+static inline void output_initial_string(elements_t::iterator letter,
+                                         sink_t& out, const std::string& str)
 {
   if (letter->token == ALIF ||
       letter->token == AYN  ||
@@ -1955,830 +2659,1216 @@ static inline void output_initial_string(std::list<element_t>::iterator letter,
   }
 }
 
-void output_latex_house(std::list<element_t>& in, std::ostream& out,
-                        mode_t mode)
+static const glyph_t latex_house_glyphs[] = {
+  /* NONE          */ NO_GLYPH,
+  /* FIRST         */ NO_GLYPH,
+  /* ALIF          */ NO_GLYPH,
+  /* BIH           */ GLYPH4("b", "B", "bb", "BB"),
+  /* TIH           */ GLYPH4("t", "T", "tt", "TT"),
+  /* THIH          */ GLYPH4("\\underline{th}", "\\underline{Th}",
+                             "\\underline{th}\\underline{th}",
+                             "\\underline{Th}\\underline{th}"),
+  /* JIIM          */ GLYPH4("j", "J", "jj", "JJ"),
+  /* HIH_HUTII     */ GLYPH4("\\d{h}", "\\d{H}",
+                             "\\d{h}\\d{h}",
+                             "\\d{H}\\d{h}"),
+  /* KHIH          */ GLYPH4("\\underline{kh}", "\\underline{Kh}",
+                             "\\underline{kh}\\underline{kh}",
+                             "\\underline{Kh}\\underline{kh}"),
+  /* SIIN          */ GLYPH4("s", "S", "ss", "SS"),
+  /* SHIIN         */ GLYPH4("\\underline{sh}", "\\underline{Sh}",
+                             "\\underline{sh}\\underline{sh}",
+                             "\\underline{Sh}\\underline{sh}"),
+  /* DAAL          */ GLYPH4("d", "D", "dd", "DD"),
+  /* DHAAL         */ GLYPH4("\\underline{dh}", "\\underline{Dh}",
+                             "\\underline{dh}\\underline{dh}",
+                             "\\underline{Dh}\\underline{dh}"),
+  /* RIH           */ GLYPH4("r", "R", "rr", "RR"),
+  /* ZIH           */ GLYPH4("z", "Z", "zz", "ZZ"),
+  /* SAAD          */ GLYPH4("\\d{s}", "\\d{S}",
+                             "\\d{s}\\d{s}",
+                             "\\d{S}\\d{s}"),
+  /* THAAD         */ GLYPH4("\\d{d}", "\\d{D}",
+                             "\\d{d}\\d{d}",
+                             "\\d{D}\\d{d}"),
+  /* TAYN          */ GLYPH4("\\d{t}", "\\d{T}",
+                             "\\d{t}\\d{t}",
+                             "\\d{T}\\d{t}"),
+  /* DTHAYN        */ GLYPH4("\\d{z}", "\\d{Z}",
+                             "\\d{z}\\d{z}",
+                             "\\d{Z}\\d{z}"),
+  /* AYN           */ GLYPH("`"),
+  /* GHAYN         */ GLYPH4("\\underline{gh}", "\\underline{Gh}",
+                             "\\underline{gh}\\underline{gh}",
+                             "\\underline{Gh}\\underline{gh}"),
+  /* FIH           */ GLYPH4("f", "F", "ff", "FF"),
+  /* QAAF          */ GLYPH4("q", "Q", "qq", "QQ"),
+  /* KAAF          */ GLYPH4("k", "K", "kk", "KK"),
+  /* LAAM          */ GLYPH4("l", "L", "ll", "LL"),
+  /* MIIM          */ GLYPH4("m", "M", "mm", "MM"),
+  /* NUUN          */ GLYPH4("n", "N", "nn", "NN"),
+  /* WAAW          */ NO_GLYPH,
+  /* YIH           */ NO_GLYPH,
+  /* ALIF_MAQSURA  */ GLYPH4("\\'{a}", "\\'{A}", "\\'{a}", "\\'{A}"),
+  /* HIH           */ GLYPH4("h", "H", "hh", "HH"),
+  /* TIH_MARBUTA   */ GLYPH4("t", "T", "tt", "TT"),
+  /* HAMZA         */ GLYPH("'"),
+  /* PIH           */ GLYPH4("p", "P", "pp", "PP"),
+  /* CHIH          */ GLYPH4("\\underline{ch}", "\\underline{Ch}",
+                             "\\underline{ch}\\underline{ch}",
+                             "\\underline{Ch}\\underline{ch}"),
+  /* ZHIH          */ GLYPH4("\\underline{zh}", "\\underline{Zh}",
+                             "\\underline{zh}\\underline{zh}",
+                             "\\underline{Zh}\\underline{zh}"),
+  /* GAAF          */ GLYPH4("g", "G", "gg", "GG"),
+  /* LAST          */ NO_GLYPH,
+  /* PREFIX_AL     */ GLYPH4("al-", "Al-", "al-", "Al-"),
+  /* PREFIX_BI     */ GLYPH4("bi-", "Bi-", "bi-", "Bi-"),
+  /* PREFIX_LI     */ GLYPH4("li-", "Li-", "li-", "Li-"),
+  /* PREFIX_WA     */ GLYPH4("wa-", "Wa-", "wa-", "Wa-"),
+  /* PREFIX_MII    */ GLYPH4("m\\'{\\i}-", "M\\'{\\i}-",
+                             "m\\'{\\i}-",
+                             "M\\'{\\i}-"),
+  /* SUFFIX_RAA    */ GLYPH("-r\\'{a}"),
+  /* SUFFIX_HAA    */ GLYPH("-h\\'{a}"),
+  /* SUFFIX_II     */ GLYPH("\\'{\\i}"),
+  /* PERIOD        */ GLYPH("."),
+  /* COMMA         */ GLYPH(","),
+  /* SEMICOLON     */ GLYPH(";"),
+  /* COLON         */ GLYPH(":"),
+  /* EXCLAM        */ GLYPH("!"),
+  /* QUERY         */ GLYPH("?"),
+  /* SPACE         */ GLYPH(" "),
+  /* PARAGRAPH     */ NO_GLYPH,
+  /* LEFT_QUOTE    */ GLYPH("``"),
+  /* RIGHT_QUOTE   */ GLYPH("''"),
+  /* SPACER        */ GLYPH("-"),
+#ifdef MODE_STACK
+  /* PUSH_MODE     */ NO_GLYPH,
+  /* POP_MODE      */ NO_GLYPH,
+#endif
+  /* UNKNOWN       */ NO_GLYPH,
+};
+CHECK_GLYPHS(latex_house_glyphs, END);
+
+std::size_t output_latex_house_step(context_t&, elements_t::iterator,
+                                    elements_t::iterator letter,
+                                    elements_t::iterator end, sink_t& out)
 {
-  std::list<element_t>::iterator letter = in.begin();
+  elements_t::iterator start = letter;
 
-  while (letter != in.end()) {
-    switch (letter->token) {
-    case ALIF:
-      if (letter->flags & TF_VOWEL) {
+  switch (letter->token) {
+  case ALIF:
+    if (letter->flags & TF_VOWEL) {
+      out << "\\'{";
+      output_string(letter, out, "a}");
+    }
+    break;
+
+  case WAAW:
+    if (letter->flags & TF_DIPHTHONG) {
+      output_string(letter, out, "w", true);
+    }
+    else if (letter->flags & TF_CONSONANT) {
+      output_string(letter, out, "v", true);
+    }
+    else if (letter->flags & TF_VOWEL) {
+      if (letter->flags & TF_SILENT) {
+        output_string(letter, out, "aw"); // jww (2002-10-30): ???
+      } else {
         out << "\\'{";
-        output_string(letter, out, "a}");
+        output_string(letter, out, "u}");
       }
-      break;
+    }
+    break;
 
-    case BIH:
-      output_string(letter, out, "b", true);
-      break;
+  case YIH:
+    if (letter->flags & (TF_CONSONANT | TF_DIPHTHONG)) {
+      output_string(letter, out, "y", true);
+    }
+    else if (letter->flags & TF_VOWEL) {
+      if (letter->flags & TF_CAPITALIZE)
+        out << "\\'{I}";
+      else
+        out << "\\'{\\i}";
+    }
+    break;
 
-    case TIH:
-      output_string(letter, out, "t", true);
-      break;
+  case PARAGRAPH:
+    out << '\n'
+        << '\n';
+    break;
 
-    case THIH:
-      out << "\\underline{";
-      output_string(letter, out, "th}");
 
-      if (letter->flags & TF_SHADDA)
-        out << "\\underline{th}";
-      break;
+#ifdef MODE_STACK
+  case PUSH_MODE:
+  case POP_MODE:
+    break;                // we ignore it
+#endif // MODE_STACK
 
-    case JIIM:
-      output_string(letter, out, "j", true);
-      break;
 
-    case HIH_HUTII:
-      out << "\\d{";
-      output_string(letter, out, "h}");
+  case UNKNOWN:
+    out << (char)letter->flags;
+    break;
 
-      if (letter->flags & TF_SHADDA)
-        out << "\\d{h}";
-      break;
+  default:
+    if (! output_glyph(latex_house_glyphs, *letter, out,
+                       glyph_variant(*letter)))
+      std::cerr << "output_latex_house: unhandled token "
+                << letter->token << std::endl;
+    break;
+  }
 
-    case KHIH:
-      out << "\\underline{";
-      output_string(letter, out, "kh}");
+  elements_t::iterator next = letter;
+  next++;
 
-      if (letter->flags & TF_SHADDA)
-        out << "\\underline{kh}";
-      break;
+  if (letter->flags & TF_CONSONANT &&
+      (next == end || ! (next->flags & TF_VOWEL))) {
+    if (letter->flags & TF_FATHA) {
+      output_initial_string(letter, out, "a");
+    }
+    else if (letter->flags & TF_KASRA) {
+      if (next != end && next->flags & TF_DIPHTHONG)
+        output_initial_string(letter, out, "a");
+      else
+        output_initial_string(letter, out, "i");
+    }
+    else if (letter->flags & TF_DHAMMA) {
+      if (next != end && next->flags & TF_DIPHTHONG)
+        output_initial_string(letter, out, "a");
+      else
+        output_initial_string(letter, out, "u");
+    }
+    else if (letter->flags & TF_DEFECTIVE_ALIF) {
+      out << "\\'{";
+      output_string(letter, out, "a}");
+    }
+  }
+  else if (letter->flags & TF_IZAAFIH) {
+    if (letter->flags & TF_VOWEL)
+      out << "y-i-";
+    else
+      out << "-i-";
 
-    case SIIN:
-      output_string(letter, out, "s", true);
-      break;
+    if (next != end && next->token == SPACE)
+      letter++;
+  }
 
-    case SHIIN:
-      out << "\\underline{";
-      output_string(letter, out, "sh}");
+  letter++;
 
-      if (letter->flags & TF_SHADDA)
-        out << "\\underline{sh}";
-      break;
+  return letter - start;
+}
 
-    case DAAL:
-      output_string(letter, out, "d", true);
-      break;
+void output_latex_house(context_t& ctx, elements_t& in, sink_t& out,
+                        mode_t mode)
+{
+  ctx.render.reset(mode);
 
-    case DHAAL:
-      out << "\\underline{";
-      output_string(letter, out, "dh}");
+  elements_t::iterator letter = in.begin();
+  while (letter != in.end())
+    letter += output_latex_house_step(ctx, in.begin(), letter, in.end(), out);
+}
 
-      if (letter->flags & TF_SHADDA)
-        out << "\\underline{dh}";
-      break;
+static const glyph_t html_house_glyphs[] = {
+  /* NONE          */ NO_GLYPH,
+  /* FIRST         */ NO_GLYPH,
+  /* ALIF          */ NO_GLYPH,
+  /* BIH           */ GLYPH4("b", "B", "bb", "BB"),
+  /* TIH           */ GLYPH4("t", "T", "tt", "TT"),
+  /* THIH          */ GLYPH4("th", "Th", "thth", "Thth"),
+  /* JIIM          */ GLYPH4("j", "J", "jj", "JJ"),
+  /* HIH_HUTII     */ GLYPH4("ḥ", "ḥ", "ḥḥ", "ḥḥ"),
+  /* KHIH          */ GLYPH4("kh", "Kh", "khkh", "Khkh"),
+  /* SIIN          */ GLYPH4("s", "S", "ss", "SS"),
+  /* SHIIN         */ GLYPH4("sh", "Sh", "shsh", "Shsh"),
+  /* DAAL          */ GLYPH4("d", "D", "dd", "DD"),
+  /* DHAAL         */ GLYPH4("dh", "Dh", "dhdh", "Dhdh"),
+  /* RIH           */ GLYPH4("r", "R", "rr", "RR"),
+  /* ZIH           */ GLYPH4("z", "Z", "zz", "ZZ"),
+  /* SAAD          */ GLYPH4("ṣ", "ṣ", "ṣṣ", "ṣṣ"),
+  /* THAAD         */ GLYPH4("ḍ", "ḍ", "ḍḍ", "ḍḍ"),
+  /* TAYN          */ GLYPH4("ṭ", "ṭ", "ṭṭ", "ṭṭ"),
+  /* DTHAYN        */ GLYPH4("ẓ", "ẓ", "ẓẓ", "ẓẓ"),
+  /* AYN           */ GLYPH("`"),
+  /* GHAYN         */ GLYPH4("gh", "Gh", "ghgh", "Ghgh"),
+  /* FIH           */ GLYPH4("f", "F", "ff", "FF"),
+  /* QAAF          */ GLYPH4("q", "Q", "qq", "QQ"),
+  /* KAAF          */ GLYPH4("k", "K", "kk", "KK"),
+  /* LAAM          */ GLYPH4("l", "L", "ll", "LL"),
+  /* MIIM          */ GLYPH4("m", "M", "mm", "MM"),
+  /* NUUN          */ GLYPH4("n", "N", "nn", "NN"),
+  /* WAAW          */ NO_GLYPH,
+  /* YIH           */ NO_GLYPH,
+  /* ALIF_MAQSURA  */ GLYPH("á"),
+  /* HIH           */ GLYPH4("h", "H", "hh", "HH"),
+  /* TIH_MARBUTA   */ GLYPH4("t", "T", "tt", "TT"),
+  /* HAMZA         */ GLYPH("'"),
+  /* PIH           */ GLYPH4("p", "P", "pp", "PP"),
+  /* CHIH          */ GLYPH4("ch", "Ch", "chch", "Chch"),
+  /* ZHIH          */ GLYPH4("zh", "Zh", "zhzh", "Zhzh"),
+  /* GAAF          */ GLYPH4("g", "G", "gg", "GG"),
+  /* LAST          */ NO_GLYPH,
+  /* PREFIX_AL     */ NO_GLYPH,
+  /* PREFIX_BI     */ GLYPH4("bi-", "Bi-", "bi-", "Bi-"),
+  /* PREFIX_LI     */ GLYPH4("li-", "Li-", "li-", "Li-"),
+  /* PREFIX_WA     */ GLYPH4("wa-", "Wa-", "wa-", "Wa-"),
+  /* PREFIX_MII    */ GLYPH4("mí-", "Mí-", "mí-", "Mí-"),
+  /* SUFFIX_RAA    */ GLYPH("-rá"),
+  /* SUFFIX_HAA    */ GLYPH("-há"),
+  /* SUFFIX_II     */ GLYPH("í"),
+  /* PERIOD        */ GLYPH("."),
+  /* COMMA         */ GLYPH(","),
+  /* SEMICOLON     */ GLYPH(";"),
+  /* COLON         */ GLYPH(":"),
+  /* EXCLAM        */ GLYPH("!"),
+  /* QUERY         */ GLYPH("?"),
+  /* SPACE         */ GLYPH(" "),
+  /* PARAGRAPH     */ NO_GLYPH,
+  /* LEFT_QUOTE    */ GLYPH("“”"),
+  /* RIGHT_QUOTE   */ GLYPH("”"),
+  /* SPACER        */ GLYPH("-"),
+#ifdef MODE_STACK
+  /* PUSH_MODE     */ NO_GLYPH,
+  /* POP_MODE      */ NO_GLYPH,
+#endif
+  /* UNKNOWN       */ NO_GLYPH,
+};
+CHECK_GLYPHS(html_house_glyphs, END);
 
-    case RIH:
-      output_string(letter, out, "r", true);
-      break;
+std::size_t output_html_house_step(context_t&, elements_t::iterator,
+                                   elements_t::iterator letter,
+                                   elements_t::iterator end, sink_t& out)
+{
+  elements_t::iterator start = letter;
 
-    case ZIH:
-      output_string(letter, out, "z", true);
-      break;
+  switch (letter->token) {
+  case ALIF:
+    if (letter->flags & TF_VOWEL)
+      output_string(letter, out, "á");
+    break;
 
-    case SAAD:
-      out << "\\d{";
-      output_string(letter, out, "s}");
+  case WAAW:
+    if (letter->flags & TF_DIPHTHONG) {
+      output_string(letter, out, "w", true);
+    }
+    else if (letter->flags & TF_CONSONANT) {
+      output_string(letter, out, "v", true);
+    }
+    else if (letter->flags & TF_VOWEL) {
+      if (letter->flags & TF_SILENT) {
+        output_string(letter, out, "aw"); // jww (2002-10-30): ???
+      } else {
+        output_string(letter, out, "ú");
+      }
+    }
+    break;
 
-      if (letter->flags & TF_SHADDA)
-        out << "\\d{s}";
-      break;
+  case YIH:
+    if (letter->flags & (TF_CONSONANT | TF_DIPHTHONG)) {
+      output_string(letter, out, "y", true);
+    }
+    else if (letter->flags & TF_VOWEL) {
+      if (letter->flags & TF_CAPITALIZE)
+        out << "Í";
+      else
+        out << "í";
+    }
+    break;
 
-    case THAAD:
-      out << "\\d{";
-      output_string(letter, out, "d}");
+  case PREFIX_AL:
+    if (letter->flags & TF_SUN_LETTER)
+      output_string(letter, out, "a-");
+    else
+      output_string(letter, out, "al-");
+    break;
 
-      if (letter->flags & TF_SHADDA)
-        out << "\\d{d}";
-      break;
+  case PARAGRAPH:
+    out << '\n'
+        << '\n';
+    break;
 
-    case TAYN:
-      out << "\\d{";
-      output_string(letter, out, "t}");
 
-      if (letter->flags & TF_SHADDA)
-        out << "\\d{t}";
-      break;
+#ifdef MODE_STACK
+  case PUSH_MODE:
+  case POP_MODE:
+    break;                // we ignore it
+#endif // MODE_STACK
 
-    case DTHAYN:
-      out << "\\d{";
-      output_string(letter, out, "z}");
 
-      if (letter->flags & TF_SHADDA)
-        out << "\\d{z}";
-      break;
+  case UNKNOWN:
+    out << (char)letter->flags;
+    break;
 
-    case AYN:
-      out << '`';
-      break;
+  default:
+    if (! output_glyph(html_house_glyphs, *letter, out,
+                       glyph_variant(*letter)))
+      std::cerr << "output_latex_house: unhandled token "
+                << letter->token << std::endl;
+    break;
+  }
 
-    case GHAYN:
-      out << "\\underline{";
-      output_string(letter, out, "gh}");
+  elements_t::iterator next = letter;
+  next++;
 
-      if (letter->flags & TF_SHADDA)
-        out << "\\underline{gh}";
-      break;
+  if (letter->flags & TF_CONSONANT &&
+      (next == end || ! (next->flags & TF_VOWEL))) {
+    if (letter->flags & TF_FATHA) {
+      output_initial_string(letter, out, "a");
+    }
+    else if (letter->flags & TF_KASRA) {
+      if (next != end && next->flags & TF_DIPHTHONG)
+        output_initial_string(letter, out, "a");
+      else
+        output_initial_string(letter, out, "i");
+    }
+    else if (letter->flags & TF_DHAMMA) {
+      if (next != end && next->flags & TF_DIPHTHONG)
+        output_initial_string(letter, out, "a");
+      else
+        output_initial_string(letter, out, "u");
+    }
+    else if (letter->flags & TF_DEFECTIVE_ALIF) {
+      output_string(letter, out, "á");
+    }
+  }
+  else if (letter->flags & TF_IZAAFIH) {
+    if (letter->flags & TF_VOWEL)
+      out << "y-i-";
+    else
+      out << "-i-";
 
-    case FIH:
-      output_string(letter, out, "f", true);
-      break;
+    if (next != end && next->token == SPACE)
+      letter++;
+  }
 
-    case QAAF:
-      output_string(letter, out, "q", true);
-      break;
+  letter++;
 
-    case KAAF:
-      output_string(letter, out, "k", true);
-      break;
+  return letter - start;
+}
 
-    case LAAM:
-      output_string(letter, out, "l", true);
-      break;
+void output_html_house(context_t& ctx, elements_t& in, sink_t& out,
+                       mode_t mode)
+{
+  ctx.render.reset(mode);
 
-    case MIIM:
-      output_string(letter, out, "m", true);
-      break;
+  elements_t::iterator letter = in.begin();
+  while (letter != in.end())
+    letter += output_html_house_step(ctx, in.begin(), letter, in.end(), out);
+}
 
-    case NUUN:
-      output_string(letter, out, "n", true);
-      break;
+// Simplified conversion functions
 
-    case WAAW:
-      if (letter->flags & TF_DIPHTHONG) {
-        output_string(letter, out, "w", true);
-      }
-      else if (letter->flags & TF_CONSONANT) {
-        output_string(letter, out, "v", true);
-      }
-      else if (letter->flags & TF_VOWEL) {
-        if (letter->flags & TF_SILENT) {
-          output_string(letter, out, "aw"); // jww (2002-10-30): ???
-        } else {
-          out << "\\'{";
-          output_string(letter, out, "u}");
-        }
-      }
-      break;
+typedef bool (*parse_func_t)(context_t& ctx,
+                             const char * in, std::size_t len,
+                             elements_t&, mode_t, bool only_one);
+typedef void (*output_func_t)(context_t& ctx, elements_t& in,
+                              sink_t& out, mode_t mode);
+void convert(context_t& ctx, std::istream& in, std::ostream& out,
+             mode_t mode, parse_func_t parse, output_func_t output)
+{
+  ctx.buffer.assign(std::istreambuf_iterator<char>(in),
+                    std::istreambuf_iterator<char>());
 
-    case YIH:
-      if (letter->flags & (TF_CONSONANT | TF_DIPHTHONG)) {
-        output_string(letter, out, "y", true);
-      }
-      else if (letter->flags & TF_VOWEL) {
-        if (letter->flags & TF_CAPITALIZE)
-          out << "\\'{I}";
-        else
-          out << "\\'{\\i}";
-      }
-      break;
+  // Each call starts afresh, whatever modes the last one left open
+  ctx.parse_modes.clear();
+  ctx.tokens.clear();
+  (*parse)(ctx, ctx.buffer.data(), ctx.buffer.length(), ctx.tokens, mode,
+           false);
 
-    case ALIF_MAQSURA:
-      out << "\\'{";
-      output_string(letter, out, "a}");
-      break;
+  stream_sink_t sink(out);
+  (*output)(ctx, ctx.tokens, sink, mode);
+}
 
-    case HIH:
-      output_string(letter, out, "h", true);
-      break;
+std::string convert(context_t& ctx, const std::string& in, mode_t mode,
+                    parse_func_t parse, output_func_t output)
+{
+  ctx.parse_modes.clear();
+  ctx.tokens.clear();
+  (*parse)(ctx, in.data(), in.length(), ctx.tokens, mode, false);
 
-    case TIH_MARBUTA:
-      output_string(letter, out, "t", true);
-      break;
+  std::string result;
+  {
+    string_sink_t sink(result);
+    (*output)(ctx, ctx.tokens, sink, mode);
+    sink << '\0';
+  }
+  return result;
+}
 
-    case HAMZA:
-      out << '\'';
-      break;
+// Convert `len' bytes of `in', writing at most `capacity' bytes
+// (including a terminating NUL) to `out'.  Returns the length of the
+// full result; if that is not less than `capacity', the output was
+// truncated.  Apart from growing the context's token buffer, this
+// allocates nothing.
 
+std::size_t convert(context_t& ctx, const char * in, std::size_t len,
+                    char * out, std::size_t capacity, mode_t mode,
+                    parse_func_t parse, output_func_t output)
+{
+  ctx.parse_modes.clear();
+  ctx.tokens.clear();
+  (*parse)(ctx, in, len, ctx.tokens, mode, false);
 
-      // Persian letters
+  fixed_sink_t sink(out, capacity);
+  (*output)(ctx, ctx.tokens, sink, mode);
 
-    case PIH:
-      output_string(letter, out, "p", true);
-      break;
+  sink.terminate();
+  return sink.needed();
+}
 
-    case CHIH:
-      out << "\\underline{";
-      output_string(letter, out, "ch}");
+parse_func_t find_parser(style_t style)
+{
+  switch (style) {
+  case AASAAN:   return parse_aasaan;
+  case TALATTOF: return parse_talattof;
+  case UTF8:     return parse_unicode;
+  default:
+    return NULL;
+  }
+}
 
-      if (letter->flags & TF_SHADDA)
-        out << "\\underline{ch}";
-      break;
+output_func_t find_renderer(style_t style)
+{
+  switch (style) {
+  case AASAAN:      return output_aasaan;
+  case ARABTEX:     return output_arabtex;
+  case UNICODE:     return output_unicode;
+  case LATEX_HOUSE: return output_latex_house;
+  case HTML_HOUSE:  return output_html_house;
+  case UTF8:        return output_utf8;
+  default:
+    return NULL;
+  }
+}
 
-    case ZHIH:
-      out << "\\underline{";
-      output_string(letter, out, "zh}");
+output_step_t find_output_step(style_t style)
+{
+  switch (style) {
+  case AASAAN:      return output_aasaan_step;
+  case ARABTEX:     return output_arabtex_step;
+  case UNICODE:     return output_unicode_step;
+  case LATEX_HOUSE: return output_latex_house_step;
+  case HTML_HOUSE:  return output_html_house_step;
+  case UTF8:        return output_utf8_step;
+  default:
+    return NULL;
+  }
+}
 
-      if (letter->flags & TF_SHADDA)
-        out << "\\underline{zh}";
-      break;
+// Copy `in' to `out', converting every span of it enclosed by one of
+// the delimiter pairs in `kinds' as that kind says.  The input is
+// scanned once; spans do not nest, and an opening delimiter with no
+// closing one after it is copied through as it is.  A span holds at
+// least one character, so `<<>>' is not an empty span but an opening
+// delimiter whose span, if any, goes on to a later `>>'.  Returns false,
+// having written nothing, if a kind lacks a delimiter or does not name
+// an input and an output style.
+
+bool expand_markup(context_t& ctx, const char * in, std::size_t len,
+                   const markup_t * kinds, std::size_t count, sink_t& out)
+{
+  bool starts[256] = { false };	// the first bytes of opening delimiters
+
+  for (std::size_t i = 0; i < count; i++) {
+    if (! kinds[i].open || ! *kinds[i].open ||
+        ! kinds[i].close || ! *kinds[i].close ||
+        ! find_parser(kinds[i].from) || ! find_renderer(kinds[i].to))
+      return false;
+    starts[(unsigned char) kinds[i].open[0]] = true;
+  }
 
-    case GAAF:
-      output_string(letter, out, "g", true);
-      break;
+  // Once a closing delimiter is not found, it will not be found later
+  // either, so its kind is not looked for again
+  std::vector<bool> unclosed(count, false);
+
+  std::size_t copied = 0;	// the input before this is written out
+  for (std::size_t pos = 0; pos < len; pos++) {
+    if (! starts[(unsigned char) in[pos]])
+      continue;
+
+    for (std::size_t i = 0; i < count; i++) {
+      const markup_t& kind(kinds[i]);
+      std::size_t     open = std::strlen(kind.open);
+      if (unclosed[i] || open > len - pos ||
+          std::memcmp(in + pos, kind.open, open) != 0)
+        continue;
+
+      std::size_t  close = std::strlen(kind.close);
+      const char * body	 = in + pos + open;
+      const char * end	 = std::search(std::min(body + 1, in + len), in + len,
+                                       kind.close, kind.close + close);
+      if (end == in + len) {
+        unclosed[i] = true;
+        continue;
+      }
 
+      out.write(in + copied, pos - copied);
+      if (kind.before)
+        out << kind.before;
 
-    case PREFIX_AL:
-      output_string(letter, out, "al-");
-      break;
+      // The text may be ctx.buffer, which must be left alone
+      ctx.parse_modes.clear();
+      ctx.tokens.clear();
+      (*find_parser(kind.from))(ctx, body, end - body, ctx.tokens,
+                                kind.mode, false);
+      (*find_renderer(kind.to))(ctx, ctx.tokens, out, kind.mode);
 
-    case PREFIX_BI:
-      output_string(letter, out, "bi-");
-      break;
+      if (kind.after)
+        out << kind.after;
 
-    case PREFIX_LI:
-      output_string(letter, out, "li-");
+      copied = (end - in) + close;
+      pos    = copied - 1;
       break;
+    }
+  }
+  out.write(in + copied, len - copied);
+  return true;
+}
 
-    case PREFIX_WA:
-      output_string(letter, out, "wa-");
-      break;
+// Render one buffer of tokens in several styles at once: styles[i] is
+// written to sinks[i].  The renderers advance through the tokens side
+// by side, each with its own render state, so the buffer is walked a
+// single time however many styles are wanted.  Returns false, having
+// rendered nothing, if any of the styles is not an output style.
 
-    case PREFIX_MII:
-      output_string(letter, out, "m\\'{\\i}-");
-      break;
+bool output_styles(elements_t& in, mode_t mode, const style_t * styles,
+                   sink_t * const * sinks, std::size_t count)
+{
+  enum { GROUP = 8 };
+
+  for (std::size_t i = 0; i < count; i++)
+    if (! find_output_step(styles[i]))
+      return false;
+
+  // More than eight styles are rendered eight at a time
+  for (std::size_t first = 0; first < count; first += GROUP) {
+    std::size_t	  group = std::min(count - first, std::size_t(GROUP));
+    context_t	  renders[GROUP];
+    output_step_t steps[GROUP];
+    std::size_t	  next[GROUP];
+
+    for (std::size_t i = 0; i < group; i++) {
+      renders[i].render.reset(mode);
+      steps[i] = find_output_step(styles[first + i]);
+      next[i]  = 0;
+    }
 
-    case SUFFIX_RAA:
-      out << "-r\\'{a}";
-      break;
+    elements_t::iterator begin = in.begin();
+    elements_t::iterator end   = in.end();
+    for (std::size_t t = 0; t < in.size(); t++)
+      for (std::size_t i = 0; i < group; i++)
+        if (next[i] == t)
+          next[i] += (*steps[i])(renders[i], begin, begin + t, end,
+                                 *sinks[first + i]);
+  }
+  return true;
+}
 
-    case SUFFIX_HAA:
-      out << "-h\\'{a}";
-      break;
+// Parse Aasaan text and render it in a single pass.  Rather than
+// building the whole token list first, each unit of input is parsed
+// into a small window, and tokens are rendered as soon as they are
+// settled; the window is then slid forward, so memory use and the
+// delay before the first output do not grow with the input.
+//
+// A unit of input may still revise the last two tokens parsed before
+// it, and a renderer may look up to two tokens past the one it is
+// rendering, so a token is rendered only once four more follow it.
+
+static const std::size_t fused_lookahead = 4;
+static const std::size_t fused_window	 = 64;
+
+void convert_fused(context_t& ctx, const char * in, std::size_t len,
+                   sink_t& out, mode_t mode, output_step_t step)
+{
+  elements_t& window(ctx.tokens);
+  std::size_t done = 0;		// tokens in the window already rendered
+  std::size_t pos  = 0;
 
-    case SUFFIX_II:
-      out << "\\'{\\i}";
-      break;
+  ctx.parse_modes.clear();
+  window.clear();
+  ctx.render.reset(mode);
 
+  while (pos < len) {
+    parse_aasaan(ctx, in, len, pos, window, mode, true);
 
-    case SPACE:
-      out << ' ';
-      break;
+    while (done + fused_lookahead < window.size())
+      done += (*step)(ctx, window.begin(), window.begin() + done,
+                      window.end(), out);
 
-    case PERIOD:
-      out << '.';
-      break;
+    // Keep the last rendered token, which renderers look back at
+    if (done > fused_window) {
+      window.erase(window.begin(), window.begin() + (done - 1));
+      done = 1;
+    }
+  }
 
-    case COMMA:
-      out << ',';
-      break;
+  while (done < window.size())
+    done += (*step)(ctx, window.begin(), window.begin() + done,
+                    window.end(), out);
+}
 
-    case SEMICOLON:
-      out << ';';
-      break;
+void convert_fused(context_t& ctx, const char * in, std::size_t len,
+                   std::ostream& out, mode_t mode, output_step_t step)
+{
+  stream_sink_t sink(out);
+  convert_fused(ctx, in, len, sink, mode, step);
+}
 
-    case COLON:
-      out << ':';
-      break;
+// The same, for input read from a stream as it arrives.  It is handed
+// to an aasaan_parser_t a block at a time, so a pipe of any length can
+// be converted in bounded memory.
 
-    case EXCLAM:
-      out << '!';
-      break;
+void convert_fused(context_t& ctx, std::istream& in, sink_t& out,
+                   mode_t mode, output_step_t step)
+{
+  aasaan_parser_t parser(ctx, mode);
+  elements_t&	  window(ctx.tokens);
+  std::size_t	  done = 0;
+  char		  block[8192];
+
+  ctx.parse_modes.clear();
+  window.clear();
+  ctx.render.reset(mode);
+
+  std::streamsize count;
+  while ((count = in.rdbuf()->sgetn(block, sizeof block)) > 0) {
+    parser.feed(block, count, window);
+
+    while (done + fused_lookahead < window.size())
+      done += (*step)(ctx, window.begin(), window.begin() + done,
+                      window.end(), out);
+
+    if (done > fused_window) {
+      window.erase(window.begin(), window.begin() + (done - 1));
+      done = 1;
+    }
+  }
+  parser.finish(window);
 
-    case QUERY:
-      out << '?';
-      break;
+  while (done < window.size())
+    done += (*step)(ctx, window.begin(), window.begin() + done,
+                    window.end(), out);
+}
 
-    case PARAGRAPH:
-      out << std::endl
-          << std::endl;
-      break;
+void convert_fused(context_t& ctx, std::istream& in, std::ostream& out,
+                   mode_t mode, output_step_t step)
+{
+  stream_sink_t sink(out);
+  convert_fused(ctx, in, sink, mode, step);
+}
 
+void convert(std::istream& in, std::ostream& out, mode_t mode,
+             parse_func_t parse, output_func_t output)
+{
+  context_t ctx;
+  convert(ctx, in, out, mode, parse, output);
+}
 
-    case SPACER:
-      out << '-';
-      break;
+std::string convert(const std::string& in, mode_t mode,
+                    parse_func_t parse, output_func_t output)
+{
+  context_t ctx;
+  return convert(ctx, in, mode, parse, output);
+}
 
+}
 
-    case LEFT_QUOTE:
-      out << "``";
-      break;
+// C interface
 
-    case RIGHT_QUOTE:
-      out << "''";
-      break;
+struct arabic_context {
+  arabic::context_t ctx;
+};
 
+extern "C" arabic_context * arabic_context_new(void)
+{
+  return new arabic_context;
+}
 
-#ifdef MODE_STACK
-    case PUSH_MODE:
-    case POP_MODE:
-      break;                // we ignore it
-#endif // MODE_STACK
+extern "C" void arabic_context_free(arabic_context * ctx)
+{
+  delete ctx;
+}
 
+extern "C" void arabic_context_cache(arabic_context * ctx, size_t words)
+{
+  ctx->ctx.words.set_capacity(words);
+}
 
-    case UNKNOWN:
-      out << (char)letter->flags;
-      break;
+extern "C" void arabic_cache_stats(const arabic_context * ctx,
+                                   unsigned long * hits,
+                                   unsigned long * misses,
+                                   size_t * entries, size_t * bytes)
+{
+  arabic::word_cache_t::stats_t stats = ctx->ctx.words.stats();
+  if (hits)
+    *hits = stats.hits;
+  if (misses)
+    *misses = stats.misses;
+  if (entries)
+    *entries = stats.entries;
+  if (bytes)
+    *bytes = stats.bytes;
+}
 
-    default:
-      std::cerr << "output_latex_house: unhandled token "
-                << letter->token << std::endl;
-      break;
-    }
+extern "C" size_t arabic_convert(arabic_context * ctx,
+                                 const char * in, size_t len,
+                                 int from, int to, int mode,
+                                 char * out, size_t capacity)
+{
+  arabic::parse_func_t  parse  = arabic::find_parser((arabic::style_t) from);
+  arabic::output_func_t output = arabic::find_renderer((arabic::style_t) to);
+  if (! parse || ! output)
+    return (size_t) -1;
 
-    std::list<element_t>::iterator next = letter;
-    next++;
+  return arabic::convert(ctx->ctx, in, len, out, capacity,
+                         (arabic::mode_t) mode, parse, output);
+}
 
-    if (letter->flags & TF_CONSONANT &&
-        (next == in.end() || ! (next->flags & TF_VOWEL))) {
-      if (letter->flags & TF_FATHA) {
-        output_initial_string(letter, out, "a");
-      }
-      else if (letter->flags & TF_KASRA) {
-        if (next != in.end() && next->flags & TF_DIPHTHONG)
-          output_initial_string(letter, out, "a");
-        else
-          output_initial_string(letter, out, "i");
-      }
-      else if (letter->flags & TF_DHAMMA) {
-        if (next != in.end() && next->flags & TF_DIPHTHONG)
-          output_initial_string(letter, out, "a");
-        else
-          output_initial_string(letter, out, "u");
-      }
-      else if (letter->flags & TF_DEFECTIVE_ALIF) {
-        out << "\\'{";
-        output_string(letter, out, "a}");
-      }
-    }
-    else if (letter->flags & TF_IZAAFIH) {
-      if (letter->flags & TF_VOWEL)
-        out << "y-i-";
-      else
-        out << "-i-";
+#if defined(USE_BOOST_PYTHON) || defined(STANDALONE)
 
-      if (next != in.end() && next->token == SPACE)
-        letter++;
-    }
+#include <pthread.h>
 
-    letter++;
+// The threads sharing a job, with the lock that guards it and the
+// condition signalled whenever it changes.  Only the threads that
+// could be started are kept, so there may be fewer than were asked
+// for, or none at all, and whoever starts them must allow for that.
+
+struct worker_pool_t {
+  std::vector<pthread_t> workers;
+  pthread_mutex_t	 lock;
+  pthread_cond_t	 changed;
+};
+
+static void start_workers(worker_pool_t& pool, int count,
+                          void * (*work)(void *), void * job)
+{
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.changed, NULL);
+
+  for (int i = 0; i < count; i++) {
+    pthread_t worker;
+    if (pthread_create(&worker, NULL, work, job) == 0)
+      pool.workers.push_back(worker);
   }
 }
 
-void output_html_house(std::list<element_t>& in, std::ostream& out,
-                       mode_t mode)
+static void join_workers(worker_pool_t& pool)
 {
-  std::list<element_t>::iterator letter = in.begin();
-  std::list<element_t>::iterator next = letter;
-  next++;
+  for (std::size_t i = 0; i < pool.workers.size(); i++)
+    pthread_join(pool.workers[i], NULL);
+  pool.workers.clear();
 
-  while (letter != in.end()) {
-    switch (letter->token) {
-    case ALIF:
-      if (letter->flags & TF_VOWEL)
-        output_string(letter, out, "á");
-      break;
+  pthread_cond_destroy(&pool.changed);
+  pthread_mutex_destroy(&pool.lock);
+}
 
-    case BIH:
-      output_string(letter, out, "b", true);
-      break;
+// Take the next `share' items of a job whose items are taken in turn,
+// returning the index of the first.  It may be past the last item.
 
-    case TIH:
-      output_string(letter, out, "t", true);
-      break;
+static std::size_t take_work(worker_pool_t& pool, std::size_t& next,
+                             std::size_t share)
+{
+  pthread_mutex_lock(&pool.lock);
+  std::size_t first = next;
+  next += share;
+  pthread_mutex_unlock(&pool.lock);
+  return first;
+}
 
-    case THIH:
-      output_string(letter, out, "th");
+#endif
 
-      if (letter->flags & TF_SHADDA)
-        out << "th";
-      break;
+#ifdef USE_BOOST_PYTHON
 
-    case JIIM:
-      output_string(letter, out, "j", true);
-      break;
+#include <boost/python.hpp>
+#include <boost/python/detail/api_placeholder.hpp>
+#include <Python.h>
 
-    case HIH_HUTII:
-      output_string(letter, out, "ḥ");
+using namespace boost::python;
+using namespace arabic;
 
-      if (letter->flags & TF_SHADDA)
-        out << "ḥ";
-      break;
+// Tokens also cross to and from Python packed one to a native 32-bit
+// word, the token in the low eight bits and its flags above, in a
+// bytearray or anything else with the buffer interface.  That is how
+// element_t is laid out by the compilers we build with, in which case
+// a whole buffer of tokens is copied at once.
 
-    case KHIH:
-      output_string(letter, out, "kh");
+typedef unsigned int py_packed_t;
 
-      if (letter->flags & TF_SHADDA)
-        out << "kh";
-      break;
+static bool py_packed_layout()
+{
+  element_t   elem(PREFIX_AL, TF_VOWEL | TF_BAA_KULAA);
+  py_packed_t word = 0;
+  if (sizeof(element_t) != sizeof(word))
+    return false;
+  std::memcpy(&word, &elem, sizeof word);
+  return word == (PREFIX_AL | (TF_VOWEL | TF_BAA_KULAA) << 8);
+}
 
-    case SIIN:
-      output_string(letter, out, "s", true);
-      break;
+static const bool py_packed_native = py_packed_layout();
 
-    case SHIIN:
-      output_string(letter, out, "sh");
+static void py_pack(const elements_t& elements, char * out)
+{
+  if (py_packed_native) {
+    if (! elements.empty())
+      std::memcpy(out, &elements[0], elements.size() * sizeof(py_packed_t));
+    return;
+  }
+  for (std::size_t i = 0; i < elements.size(); i++) {
+    py_packed_t word = elements[i].token | elements[i].flags << 8;
+    std::memcpy(out + i * sizeof word, &word, sizeof word);
+  }
+}
 
-      if (letter->flags & TF_SHADDA)
-        out << "sh";
-      break;
+// Returns false if a word does not hold a token, or holds a change of
+// mode with flags other than a mode.  Every word is checked as it was
+// given, before any is stored as an element_t, whose token_t cannot
+// hold the values a stray byte might have.
 
-    case DAAL:
-      output_string(letter, out, "d", true);
-      break;
+static bool py_unpack(const char * in, std::size_t count,
+                      elements_t& elements)
+{
+  for (std::size_t i = 0; i < count; i++) {
+    py_packed_t word;
+    std::memcpy(&word, in + i * sizeof word, sizeof word);
+    if ((word & 0xff) >= END)
+      return false;
+#ifdef MODE_STACK
+    if (((word & 0xff) == PUSH_MODE || (word & 0xff) == POP_MODE) &&
+        (word >> 8) != ARABIC && (word >> 8) != PERSIAN)
+      return false;
+#endif
+  }
 
-    case DHAAL:
-      output_string(letter, out, "dh");
+  elements.resize(count);
+  if (py_packed_native) {
+    if (count)
+      std::memcpy(static_cast<void *>(&elements[0]), in,
+                  count * sizeof(py_packed_t));
+  } else {
+    for (std::size_t i = 0; i < count; i++) {
+      py_packed_t word;
+      std::memcpy(&word, in + i * sizeof word, sizeof word);
+      elements[i] = element_t(token_t(word & 0xff), word >> 8);
+    }
+  }
+  return true;
+}
 
-      if (letter->flags & TF_SHADDA)
-        out << "dh";
-      break;
+object py_parse(const std::string& in, style_t style, arabic::mode_t mode,
+                bool packed)
+{
+  context_t  ctx;
+  elements_t elements;
+
+  parse_func_t pf = find_parser(style);
+  if (pf)
+    pf(ctx, in.data(), in.length(), elements, mode, false);
+
+  if (packed) {
+    PyObject * buf = PyByteArray_FromStringAndSize
+      (NULL, elements.size() * sizeof(py_packed_t));
+    if (! buf)
+      throw_error_already_set();
+    py_pack(elements, PyByteArray_AS_STRING(buf));
+    return object(handle<>(buf));
+  }
 
-    case RIH:
-      output_string(letter, out, "r", true);
-      break;
+  list py_elements;
+  for (elements_t::iterator i = elements.begin();
+       i != elements.end();
+       i++)
+    py_elements.append(*i);
+  return py_elements;
+}
 
-    case ZIH:
-      output_string(letter, out, "z", true);
-      break;
+static std::string py_render_elements(elements_t& elements, style_t style,
+                                      arabic::mode_t mode)
+{
+  output_func_t of = find_renderer(style);
+  if (! of)
+    return "";
 
-    case SAAD:
-      output_string(letter, out, "ṣ");
+  context_t   ctx;
+  std::string result;
+  {
+    string_sink_t sink(result);
+    of(ctx, elements, sink, mode);
+  }
+  return result;
+}
 
-      if (letter->flags & TF_SHADDA)
-        out << "ṣ";
-      break;
+std::string py_render(list args, style_t style, arabic::mode_t mode)
+{
+  elements_t elements;
 
-    case THAAD:
-      output_string(letter, out, "ḍ");
+  int l = len(args);
+  for (int i = 0; i < l; i++)
+    elements.push_back(extract<element_t>(args[i]));
 
-      if (letter->flags & TF_SHADDA)
-        out << "ḍ";
-      break;
+  return py_render_elements(elements, style, mode);
+}
 
-    case TAYN:
-      output_string(letter, out, "ṭ");
+std::string py_render_packed(object tokens, style_t style,
+                             arabic::mode_t mode)
+{
+  Py_buffer view;
+  if (PyObject_GetBuffer(tokens.ptr(), &view, PyBUF_SIMPLE) != 0)
+    throw_error_already_set();
+
+  elements_t elements;
+  bool	     whole = view.len % sizeof(py_packed_t) == 0;
+  bool	     valid = whole &&
+    py_unpack(static_cast<const char *>(view.buf),
+              view.len / sizeof(py_packed_t), elements);
+  PyBuffer_Release(&view);
+
+  if (! valid) {
+    PyErr_SetString(PyExc_ValueError,
+                    whole ? "packed tokens: not a valid token" :
+                    "packed tokens: not a whole number of words");
+    throw_error_already_set();
+  }
+  return py_render_elements(elements, style, mode);
+}
 
-      if (letter->flags & TF_SHADDA)
-        out << "ṭ";
-      break;
+list py_render_styles(list args, list styles, arabic::mode_t mode)
+{
+  elements_t elements;
 
-    case DTHAYN:
-      output_string(letter, out, "ẓ");
+  int l = len(args);
+  for (int i = 0; i < l; i++)
+    elements.push_back(extract<element_t>(args[i]));
 
-      if (letter->flags & TF_SHADDA)
-        out << "ẓ";
-      break;
+  int			   count = len(styles);
+  std::vector<style_t>	   ids(count);
+  std::vector<std::string> results(count);
+  for (int i = 0; i < count; i++)
+    ids[i] = extract<style_t>(styles[i]);
 
-    case AYN:
-      out << '`';
-      break;
+  bool ok;
+  {
+    std::vector<string_sink_t> owned;
+    std::vector<sink_t *>      sinks(count);
+    owned.reserve(count);	// so that the pointers to them hold
+    for (int i = 0; i < count; i++) {
+      owned.push_back(string_sink_t(results[i]));
+      sinks[i] = &owned.back();
+    }
 
-    case GHAYN:
-      output_string(letter, out, "gh");
+    ok = output_styles(elements, mode, count ? &ids[0] : NULL,
+                       count ? &sinks[0] : NULL, count);
+  }				// flushing into results
 
-      if (letter->flags & TF_SHADDA)
-        out << "gh";
-      break;
+  list py_results;
+  if (ok)
+    for (int i = 0; i < count; i++)
+      py_results.append(results[i]);
+  return py_results;
+}
 
-    case FIH:
-      output_string(letter, out, "f", true);
-      break;
+// Lets other Python threads run while C++ works on data of its own.
+// Nothing may touch a Python object until it goes out of scope.
 
-    case QAAF:
-      output_string(letter, out, "q", true);
-      break;
+struct py_unlocked_t {
+  PyThreadState * state;
 
-    case KAAF:
-      output_string(letter, out, "k", true);
-      break;
+  py_unlocked_t() : state(PyEval_SaveThread()) { }
+  ~py_unlocked_t() {
+    PyEval_RestoreThread(state);
+  }
+};
 
-    case LAAM:
-      output_string(letter, out, "l", true);
-      break;
+// A list of texts to convert, shared by the threads converting them.
+// Each takes the next few texts in turn, and has a context of its own.
 
-    case MIIM:
-      output_string(letter, out, "m", true);
-      break;
+static const std::size_t py_batch_share = 16;
 
-    case NUUN:
-      output_string(letter, out, "n", true);
-      break;
+struct py_batch_t {
+  const std::vector<std::string> * texts;
+  std::vector<std::string> *	   results;
+  parse_func_t			   parse;
+  output_func_t			   output;
+  arabic::mode_t		   mode;
+  std::size_t			   next; // the next text to be taken
+  worker_pool_t			   pool;
+};
 
-    case WAAW:
-      if (letter->flags & TF_DIPHTHONG) {
-        output_string(letter, out, "w", true);
-      }
-      else if (letter->flags & TF_CONSONANT) {
-        output_string(letter, out, "v", true);
-      }
-      else if (letter->flags & TF_VOWEL) {
-        if (letter->flags & TF_SILENT) {
-          output_string(letter, out, "aw"); // jww (2002-10-30): ???
-        } else {
-          output_string(letter, out, "ú");
-        }
-      }
-      break;
+static void * py_convert_texts(void * arg)
+{
+  py_batch_t& batch(*static_cast<py_batch_t *>(arg));
+  context_t   ctx;
 
-    case YIH:
-      if (letter->flags & (TF_CONSONANT | TF_DIPHTHONG)) {
-        output_string(letter, out, "y", true);
-      }
-      else if (letter->flags & TF_VOWEL) {
-        if (letter->flags & TF_CAPITALIZE)
-          out << "Í";
-        else
-          out << "í";
-      }
+  for (;;) {
+    std::size_t first = take_work(batch.pool, batch.next, py_batch_share);
+    std::size_t last = std::min(first + py_batch_share,
+                                batch.texts->size());
+    if (first >= last)
       break;
 
-    case ALIF_MAQSURA:
-      output_string(letter, out, "á");
-      break;
+    for (std::size_t i = first; i < last; i++) {
+      const std::string& in((*batch.texts)[i]);
 
-    case HIH:
-      output_string(letter, out, "h", true);
-      break;
+      // Which texts follow which on a thread varies from run to run,
+      // so none may see the modes another left open
+      ctx.parse_modes.clear();
+      ctx.tokens.clear();
+      batch.parse(ctx, in.data(), in.length(), ctx.tokens, batch.mode,
+                  false);
 
-    case TIH_MARBUTA:
-      output_string(letter, out, "t", true);
-      break;
+      string_sink_t sink((*batch.results)[i]);
+      batch.output(ctx, ctx.tokens, sink, batch.mode);
+    }
+  }
+  return NULL;
+}
 
-    case HAMZA:
-      out << '\'';
-      break;
+// Convert every text in a list from one style to another, returning
+// the list of results, or an empty list if either style is not of the
+// right kind.  The conversion runs with the GIL released, on up to
+// `threads' threads.
 
+list py_convert_many(list texts, style_t from, style_t to,
+                     arabic::mode_t mode, int threads)
+{
+  parse_func_t	pf = find_parser(from);
+  output_func_t of = find_renderer(to);
+  if (! pf || ! of)
+    return list();
 
-      // Persian letters
+  int			   count = len(texts);
+  std::vector<std::string> ins(count);
+  std::vector<std::string> outs(count);
+  for (int i = 0; i < count; i++)
+    ins[i] = extract<std::string>(texts[i]);
 
-    case PIH:
-      output_string(letter, out, "p", true);
-      break;
+  py_batch_t batch;
+  batch.texts	= &ins;
+  batch.results = &outs;
+  batch.parse	= pf;
+  batch.output	= of;
+  batch.mode	= mode;
+  batch.next	= 0;
 
-    case CHIH:
-      output_string(letter, out, "ch");
+  {
+    py_unlocked_t unlocked;
 
-      if (letter->flags & TF_SHADDA)
-        out << "ch";
-      break;
+    // No more threads than there are shares of the texts, counting
+    // this one, which takes its shares with the rest
+    int shares = int((count + py_batch_share - 1) / py_batch_share);
+    if (threads > shares)
+      threads = shares;
 
-    case ZHIH:
-      output_string(letter, out, "zh");
+    start_workers(batch.pool, threads - 1, py_convert_texts, &batch);
+    py_convert_texts(&batch);
+    join_workers(batch.pool);
+  }
 
-      if (letter->flags & TF_SHADDA)
-        out << "zh";
-      break;
+  list py_results;
+  for (int i = 0; i < count; i++)
+    py_results.append(outs[i]);
+  return py_results;
+}
 
-    case GAAF:
-      output_string(letter, out, "g", true);
-      break;
+// The context py_convert() uses on each thread, made the first time
+// the thread needs it and kept, with its buffers, until it exits
 
+static pthread_key_t  py_context_key;
+static pthread_once_t py_context_once = PTHREAD_ONCE_INIT;
 
-    case PREFIX_AL:
-      if (letter->flags & TF_SUN_LETTER)
-	output_string(letter, out, "a-");
-      else
-	output_string(letter, out, "al-");
-      break;
+static void py_delete_context(void * ctx)
+{
+  delete static_cast<context_t *>(ctx);
+}
 
-    case PREFIX_BI:
-      output_string(letter, out, "bi-");
-      break;
+static void py_make_context_key()
+{
+  pthread_key_create(&py_context_key, py_delete_context);
+}
 
-    case PREFIX_LI:
-      output_string(letter, out, "li-");
-      break;
+static context_t& py_context()
+{
+  pthread_once(&py_context_once, py_make_context_key);
 
-    case PREFIX_WA:
-      output_string(letter, out, "wa-");
-      break;
+  context_t * ctx = static_cast<context_t *>
+    (pthread_getspecific(py_context_key));
+  if (! ctx) {
+    ctx = new context_t;
+    pthread_setspecific(py_context_key, ctx);
+  }
+  return *ctx;
+}
 
-    case PREFIX_MII:
-      output_string(letter, out, "mí-");
-      break;
+// Convert a text from one style to another without building Python
+// objects for its tokens, or return "" if either style is not of the
+// right kind.
 
-    case SUFFIX_RAA:
-      out << "-rá";
-      break;
-
-    case SUFFIX_HAA:
-      out << "-há";
-      break;
-
-    case SUFFIX_II:
-      out << "í";
-      break;
-
-
-    case SPACE:
-      out << ' ';
-      break;
-
-    case PERIOD:
-      out << '.';
-      break;
-
-    case COMMA:
-      out << ',';
-      break;
-
-    case SEMICOLON:
-      out << ';';
-      break;
-
-    case COLON:
-      out << ':';
-      break;
-
-    case EXCLAM:
-      out << '!';
-      break;
-
-    case QUERY:
-      out << '?';
-      break;
-
-    case PARAGRAPH:
-      out << std::endl
-          << std::endl;
-      break;
-
-
-    case SPACER:
-      out << '-';
-      break;
-
-
-    case LEFT_QUOTE:
-      out << "“”";
-      break;
-
-    case RIGHT_QUOTE:
-      out << "”";
-      break;
-
-
-#ifdef MODE_STACK
-    case PUSH_MODE:
-    case POP_MODE:
-      break;                // we ignore it
-#endif // MODE_STACK
-
-
-    case UNKNOWN:
-      out << (char)letter->flags;
-      break;
-
-    default:
-      std::cerr << "output_latex_house: unhandled token "
-                << letter->token << std::endl;
-      break;
-    }
-
-    if (letter->flags & TF_CONSONANT &&
-        (next == in.end() || ! (next->flags & TF_VOWEL))) {
-      if (letter->flags & TF_FATHA) {
-        output_initial_string(letter, out, "a");
-      }
-      else if (letter->flags & TF_KASRA) {
-        if (next != in.end() && next->flags & TF_DIPHTHONG)
-          output_initial_string(letter, out, "a");
-        else
-          output_initial_string(letter, out, "i");
-      }
-      else if (letter->flags & TF_DHAMMA) {
-        if (next != in.end() && next->flags & TF_DIPHTHONG)
-          output_initial_string(letter, out, "a");
-        else
-          output_initial_string(letter, out, "u");
-      }
-      else if (letter->flags & TF_DEFECTIVE_ALIF) {
-        output_string(letter, out, "á");
-      }
-    }
-    else if (letter->flags & TF_IZAAFIH) {
-      if (letter->flags & TF_VOWEL)
-        out << "y-i-";
-      else
-        out << "-i-";
-
-      if (next != in.end() && next->token == SPACE)
-        letter++;
-    }
-
-    letter++;
-  }
-}
-
-// Simplified conversion functions
-
-typedef bool (*parse_func_t)(std::istream&, std::list<element_t>&,
-                             mode_t, bool only_one);
-typedef void (*output_func_t)(std::list<element_t>& in,
-                              std::ostream& out, mode_t mode);
-
-void convert(std::istream& in, std::ostream& out, mode_t mode,
-             parse_func_t parse, output_func_t output)
-{
-  std::list<element_t> tokens;
-  (*parse)(std::cin, tokens, mode, false);
-  (*output)(tokens, std::cout, mode);
-}
-
-std::string convert(const std::string& in, mode_t mode,
-                    parse_func_t parse, output_func_t output)
+std::string py_convert(const std::string& in, style_t from, style_t to,
+                       arabic::mode_t mode)
 {
-  std::list<element_t> tokens;
-
-  std::istringstream sin(in.c_str());
-  (*parse)(sin, tokens, mode, false);
-
-  std::ostringstream sout;
-  (*output)(tokens, sout, mode);
-  sout << '\0';
-
-  return sout.str();
-}
-
-char * convert(const char *in, mode_t mode,
-               parse_func_t parse, output_func_t output)
-{
-  static char buf[4096];
-
-  std::list<element_t> tokens;
-
-  std::istringstream sin(in);
-  (*parse)(sin, tokens, mode, false);
-
-  std::ostringstream sout;
-  (*output)(tokens, sout, mode);
-  sout << '\0';
-
-  std::strcpy(buf, sout.str().c_str());
-
-  return buf;
-}
+  parse_func_t	pf = find_parser(from);
+  output_func_t of = find_renderer(to);
+  if (! pf || ! of)
+    return "";
 
+  std::string result;
+  {
+    py_unlocked_t unlocked;
+    result = convert(py_context(), in, mode, pf, of);
+  }
+  // convert() ends its result with a NUL, which Python has no use for
+  if (! result.empty())
+    result.resize(result.length() - 1);
+  return result;
 }
 
-#ifdef USE_BOOST_PYTHON
-
-#include <boost/python.hpp>
-#include <boost/python/detail/api_placeholder.hpp>
-#include <Python.h>
-
-using namespace boost::python;
-using namespace arabic;
-
-namespace arabic {
-  enum style_t {
-    AASAAN,
-    ARABTEX,
-    UNICODE,
-    LATEX_HOUSE,
-    HTML_HOUSE,
-    TALATTOF
-  };
-}
+// Expand the spans of a text, each kind given as a tuple of (open,
+// close, from_style, to_style, mode), optionally followed by the text
+// to write before and after each span converted.  Returns None if a
+// kind is not valid.
 
-list py_parse(const std::string& in, style_t style, arabic::mode_t mode)
+object py_expand(const std::string& in, list py_kinds)
 {
-  std::list<element_t> elements;
+  int			   count = len(py_kinds);
+  std::vector<markup_t>	   kinds(count);
+  std::vector<std::string> strings(4 * count);
+
+  for (int i = 0; i < count; i++) {
+    tuple kind(py_kinds[i]);
+    int	  items = len(kind);
+    if (items != 5 && items != 7) {
+      PyErr_SetString(PyExc_ValueError,
+                      "expand: a kind is (open, close, from_style, "
+                      "to_style, mode[, before, after])");
+      throw_error_already_set();
+    }
 
-  parse_func_t pf;
-  switch (style) {
-  case AASAAN:   pf = parse_aasaan;   break;
-  case TALATTOF: pf = parse_talattof; break;
-  default:
-    return list();
+    strings[4 * i]     = extract<std::string>(kind[0]);
+    strings[4 * i + 1] = extract<std::string>(kind[1]);
+    kinds[i].open  = strings[4 * i].c_str();
+    kinds[i].close = strings[4 * i + 1].c_str();
+    kinds[i].from  = extract<style_t>(kind[2]);
+    kinds[i].to	   = extract<style_t>(kind[3]);
+    kinds[i].mode  = extract<arabic::mode_t>(kind[4]);
+
+    kinds[i].before = kinds[i].after = NULL;
+    if (items == 7) {
+      strings[4 * i + 2] = extract<std::string>(kind[5]);
+      strings[4 * i + 3] = extract<std::string>(kind[6]);
+      kinds[i].before = strings[4 * i + 2].c_str();
+      kinds[i].after  = strings[4 * i + 3].c_str();
+    }
   }
 
-  std::istringstream sin(in.c_str());
-  pf(sin, elements, mode, false);
-
-  list py_elements;
-  for (std::list<element_t>::iterator i = elements.begin();
-       i != elements.end();
-       i++)
-    py_elements.append(*i);
-  return py_elements;
-}
-
-std::string py_render(list args, style_t style, arabic::mode_t mode)
-{
-  std::list<element_t> elements;
-
-  int l = len(args);
-  for (int i = 0; i < l; i++)
-    elements.push_back(extract<element_t>(args[i]));
-
-  output_func_t of;
-  switch (style) {
-  case AASAAN:      of = output_aasaan;      break;
-  case ARABTEX:     of = output_arabtex;     break;
-  case UNICODE:     of = output_unicode;     break;
-  case LATEX_HOUSE: of = output_latex_house; break;
-  case HTML_HOUSE:  of = output_html_house;  break;
-  default:
-    return "";
+  std::string result;
+  bool	      ok;
+  {
+    py_unlocked_t unlocked;
+    context_t	  ctx;
+    string_sink_t sink(result);
+    ok = expand_markup(ctx, in.data(), in.length(),
+                       count ? &kinds[0] : NULL, count, sink);
   }
-
-  std::ostringstream sout;
-  of(elements, sout, mode);
-
-  return sout.str();
+  return ok ? object(result) : object();
 }
 
 BOOST_PYTHON_MODULE(arabic) {
@@ -2871,8 +3961,8 @@ BOOST_PYTHON_MODULE(arabic) {
 
   class_ < element_t > ("Element")
     .def(init<token_t, optional<unsigned long> >())
-    .def_readwrite("token", &element_t::token)
-    .def_readwrite("flags", &element_t::flags)
+    .add_property("token", &element_t::token_of, &element_t::set_token)
+    .add_property("flags", &element_t::flags_of, &element_t::set_flags)
     .def(self == self)
     .def(self != self)
     ;
@@ -2889,28 +3979,1337 @@ BOOST_PYTHON_MODULE(arabic) {
     .value("LATEX_HOUSE", LATEX_HOUSE)
     .value("HTML_HOUSE",  HTML_HOUSE)
     .value("TALATTOF",    TALATTOF)
+    .value("UTF8",        UTF8)
     ;
 
-  def("parse",  py_parse);
+  def("parse",  py_parse,
+      (arg("text"), arg("style"), arg("mode"), arg("packed") = false));
+  // Tried in the reverse order: a list of elements, else packed tokens
+  def("render", py_render_packed);
   def("render", py_render);
+  def("render_styles", py_render_styles);
+  def("expand", py_expand, (arg("text"), arg("kinds")));
+  def("convert", py_convert,
+      (arg("text"), arg("from_style"), arg("to_style"), arg("mode")));
+  def("convert_many", py_convert_many,
+      (arg("texts"), arg("from_style"), arg("to_style"), arg("mode"),
+       arg("threads") = 1));
 }
 
 #endif // USE_BOOST_PYTHON
 
 #ifdef STANDALONE
 
+#include <cerrno>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// With -j N, the input is cut at blank lines into chunks which N
+// threads convert at once.  Where a chunk begins, the parser and
+// renderer still carry some state over from the text before it: the
+// mode, and for the Unicode renderer the last token and letter seen.
+// So each thread first converts the paragraph preceding its chunk,
+// throwing the output away, to arrive at the state the chunk most
+// likely starts in.  The chunks are written out in order as they are
+// finished; if a guess turns out to have been wrong, that chunk is
+// converted again from the right state, so the result is always
+// exactly what a conversion of the whole input in one piece gives.
+
+struct chunk_state_t {
+  arabic::mode_t	      mode;	   // the parser's mode
+  std::vector<arabic::mode_t> parse_modes;
+  arabic::elements_t	      tail;	   // the last tokens parsed
+  std::size_t		      held;	   // how many are not rendered
+  arabic::render_state_t      render;
+
+  chunk_state_t() : mode(arabic::ARABIC), held(0) {}
+
+  bool operator==(const chunk_state_t& other) const {
+    return (mode == other.mode && parse_modes == other.parse_modes &&
+	    tail == other.tail && held == other.held &&
+	    render == other.render);
+  }
+};
+
+struct chunk_t {
+  std::size_t	warmup;		// where the paragraph before it starts
+  std::size_t	begin;
+  std::size_t	end;
+  chunk_state_t start;		// the state guessed for `begin'
+  chunk_state_t finish;		// and the state it leaves at `end'
+  std::string	output;
+  bool		done;
+};
+
+struct chunk_job_t {
+  const char *		in;
+  std::size_t		len;
+  arabic::mode_t	mode;
+  arabic::output_step_t step;
+  std::vector<chunk_t>	chunks;
+  std::size_t		next;	 // the next chunk to be taken
+  std::size_t		written; // chunks written out so far
+  std::size_t		ahead;	 // how far past that to work
+  worker_pool_t		pool;
+};
+
+// Convert in[begin, end) starting from `state', which is updated to
+// the state at `end'.  The last few tokens before the chunk are placed
+// ahead of it, so that the parser and renderers looking back see what
+// they would in the whole input.  If `more' text follows, the chunk's
+// own last two tokens are held back for the next chunk to render: the
+// parse of its first word may still revise them, as aasaan_parser_t
+// allows for, and how a space is rendered depends on what follows.
+// One token more is kept for the first of them to look back at.
+
+static void convert_chunk(arabic::context_t& ctx, const char * in,
+                          std::size_t begin, std::size_t end, bool more,
+                          chunk_state_t& state, arabic::sink_t& out,
+                          arabic::output_step_t step)
+{
+  arabic::elements_t& tokens(ctx.tokens);
+  tokens.assign(state.tail.begin(), state.tail.end());
+
+  std::size_t done = tokens.size() - state.held;
+  std::size_t pos  = 0;
+
+  ctx.parse_modes = state.parse_modes;
+  arabic::parse_aasaan(ctx, in + begin, end - begin, pos, tokens,
+                       state.mode, false);
+
+  std::size_t stop = tokens.size();
+  if (more)
+    stop = stop < done + 2 ? done : stop - 2;
+
+  ctx.render = state.render;
+  while (done < stop)
+    done += (*step)(ctx, tokens.begin(), tokens.begin() + done,
+                    tokens.end(), out);
+
+  std::size_t keep = tokens.size() < 3 ? tokens.size() : 3;
+
+  state.parse_modes = ctx.parse_modes;
+  state.tail.assign(tokens.end() - keep, tokens.end());
+  state.held   = tokens.size() - done;
+  state.render = ctx.render;
+}
+
+// Return where the first paragraph break at or after `pos' ends, or
+// `len'.  A break is a run of whitespace holding a blank line; the
+// parser reads it as one SPACE or PARAGRAPH token whatever follows.
+// Breaks after `^' or `~' are passed over, since the parser may look
+// beyond them.
+
+static std::size_t paragraph_end(const char * in, std::size_t len,
+                                 std::size_t pos)
+{
+  for (; pos < len; pos++) {
+    if (in[pos] != '\n' || pos == 0)
+      continue;
+
+    std::size_t start = pos;
+    while (start > 0 && arabic::aasaan_space(in[start - 1]))
+      start--;
+    if (start == 0 || in[start - 1] == '^' || in[start - 1] == '~')
+      continue;
+
+    int	        returns = 0;
+    std::size_t end     = start;
+    for (; end < len && arabic::aasaan_space(in[end]); end++)
+      if (in[end] == '\n')
+        returns++;
+
+    if (returns > 1)
+      return end;
+    pos = end;
+  }
+  return len;
+}
+
+// Return the token the parser makes of the break ending at `end'.  As
+// in parse_aasaan, only the newlines after its first character count.
+
+static arabic::token_t break_token(const char * in, std::size_t end)
+{
+  int returns = 0;
+  for (; end > 1 && arabic::aasaan_space(in[end - 2]); end--)
+    if (in[end - 1] == '\n')
+      returns++;
+
+  return returns > 1 ? arabic::PARAGRAPH : arabic::SPACE;
+}
+
+static void * convert_chunks(void * arg)
+{
+  chunk_job_t&	    job(*static_cast<chunk_job_t *>(arg));
+  arabic::context_t ctx;
+  std::string	    discard;
+
+  for (;;) {
+    pthread_mutex_lock(&job.pool.lock);
+    while (job.next < job.chunks.size() &&
+           job.next >= job.written + job.ahead)
+      pthread_cond_wait(&job.pool.changed, &job.pool.lock);
+    std::size_t i = job.next++;
+    pthread_mutex_unlock(&job.pool.lock);
+    if (i >= job.chunks.size())
+      break;
+
+    chunk_t&	  chunk(job.chunks[i]);
+    chunk_state_t state;
+    state.mode = job.mode;
+    state.render.reset(job.mode);
+    if (chunk.warmup > 0) {
+      state.tail.assign(1, break_token(job.in, chunk.warmup));
+      state.held = 1;
+    }
+
+    if (chunk.warmup < chunk.begin) {
+      discard.clear();
+      arabic::string_sink_t sink(discard);
+      convert_chunk(ctx, job.in, chunk.warmup, chunk.begin, true, state,
+                    sink, job.step);
+    }
+    chunk.start = state;
+
+    {
+      arabic::string_sink_t sink(chunk.output);
+      convert_chunk(ctx, job.in, chunk.begin, chunk.end,
+                    chunk.end < job.len, state, sink, job.step);
+    }
+    chunk.finish = state;
+
+    pthread_mutex_lock(&job.pool.lock);
+    chunk.done = true;
+    pthread_cond_broadcast(&job.pool.changed);
+    pthread_mutex_unlock(&job.pool.lock);
+  }
+  return NULL;
+}
+
+static void convert_parallel(const char * in, std::size_t len,
+                             std::ostream& out, arabic::mode_t mode,
+                             arabic::output_step_t step, int threads)
+{
+  chunk_job_t job;
+  job.in   = in;
+  job.len  = len;
+  job.mode = mode;
+  job.step = step;
+  job.next    = 0;
+  job.written = 0;
+  job.ahead   = threads * 4;
+
+  // Aim for several chunks per thread, so that none sits idle while
+  // another finishes a long one, but keep them small enough that the
+  // output held back while waiting for an earlier chunk stays modest
+  std::size_t size = len / (threads * 4);
+  if (size < 16384)
+    size = 16384;
+  else if (size > 262144)
+    size = 262144;
+
+  std::size_t last_break = 0;
+  for (std::size_t pos = 0; pos < len; ) {
+    chunk_t chunk;
+    chunk.done	= false;
+    chunk.begin = pos;
+    chunk.end	= paragraph_end(in, len, pos + size);
+
+    // The paragraph before the chunk serves to warm up its state
+    chunk.warmup = last_break;
+    for (std::size_t p = paragraph_end(in, len, last_break);
+         p < chunk.begin; p = paragraph_end(in, len, p))
+      chunk.warmup = p;
+    last_break = chunk.warmup;
+
+    job.chunks.push_back(chunk);
+    pos = chunk.end;
+  }
+
+  start_workers(job.pool, threads, convert_chunks, &job);
+
+  arabic::context_t ctx;
+  chunk_state_t	    state;
+  state.mode = mode;
+  state.render.reset(mode);
+
+  for (std::size_t i = 0; i < job.chunks.size(); i++) {
+    chunk_t& chunk(job.chunks[i]);
+
+    // With no workers to convert it, the chunk is converted here
+    pthread_mutex_lock(&job.pool.lock);
+    while (! chunk.done && ! job.pool.workers.empty())
+      pthread_cond_wait(&job.pool.changed, &job.pool.lock);
+    pthread_mutex_unlock(&job.pool.lock);
+
+    if (chunk.done && chunk.start == state) {
+      out.write(chunk.output.data(), chunk.output.length());
+      state = chunk.finish;
+    } else {
+      arabic::stream_sink_t sink(out);
+      convert_chunk(ctx, in, chunk.begin, chunk.end, chunk.end < len,
+                    state, sink, step);
+    }
+    std::string().swap(chunk.output);
+
+    pthread_mutex_lock(&job.pool.lock);
+    job.written = i + 1;
+    pthread_cond_broadcast(&job.pool.changed);
+    pthread_mutex_unlock(&job.pool.lock);
+  }
+
+  join_workers(job.pool);
+}
+
+// Parse all of `in' and render it to `out', returning the number of
+// tokens the parser could make nothing of.
+
+static std::size_t convert_all(arabic::context_t& ctx,
+                               const char * in, std::size_t len,
+                               arabic::sink_t& out, arabic::mode_t mode,
+                               arabic::parse_func_t parse,
+                               arabic::output_step_t step)
+{
+  arabic::elements_t& tokens(ctx.tokens);
+
+  ctx.reset();
+  (*parse)(ctx, in, len, tokens, mode, false);
+
+  std::size_t unknown = 0;
+  for (arabic::elements_t::const_iterator i = tokens.begin();
+       i != tokens.end(); i++)
+    if (i->token == arabic::UNKNOWN)
+      unknown++;
+
+  ctx.render.reset(mode);
+  std::size_t done = 0;
+  while (done < tokens.size())
+    done += (*step)(ctx, tokens.begin(), tokens.begin() + done,
+                    tokens.end(), out);
+
+  return unknown;
+}
+
+// With -o DIR, each file named on the command line is converted into a
+// file of the same name in DIR.  The files are shared out among the -j
+// threads, each of which maps a file into memory, converts it whole,
+// and notes how it went for the report printed at the end.
+
+struct batch_file_t {
+  std::string path;
+  std::string output;
+  std::size_t bytes;		// read
+  std::size_t written;
+  std::size_t unknown;		// tokens not understood
+  double      seconds;
+  std::string error;		// empty if it was converted
+};
+
+struct batch_job_t {
+  arabic::mode_t	    mode;
+  arabic::parse_func_t	    parse;
+  arabic::output_step_t	    step;
+  std::vector<batch_file_t> files;
+  std::size_t		    next; // the next file to be taken
+  worker_pool_t		    pool;
+};
+
+static double seconds_now()
+{
+  timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec + now.tv_usec / 1e6;
+}
+
+static void convert_file(arabic::context_t& ctx, const batch_job_t& job,
+                         batch_file_t& file)
+{
+  int fd = open(file.path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    file.error = std::strerror(errno);
+    return;
+  }
+
+  struct stat in_stat, out_stat;
+  if (fstat(fd, &in_stat) != 0 || ! S_ISREG(in_stat.st_mode)) {
+    file.error = "not a regular file";
+    close(fd);
+    return;
+  }
+  if (stat(file.output.c_str(), &out_stat) == 0 &&
+      out_stat.st_dev == in_stat.st_dev && out_stat.st_ino == in_stat.st_ino) {
+    file.error = "output would overwrite it";
+    close(fd);
+    return;
+  }
+
+  // mmap cannot map an empty file, but there is nothing to map anyway
+  file.bytes = in_stat.st_size;
+  void * data = NULL;
+  if (file.bytes > 0) {
+    data = mmap(NULL, file.bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      file.error = std::strerror(errno);
+      close(fd);
+      return;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(data, file.bytes, MADV_SEQUENTIAL);
+#endif
+  }
+  close(fd);
+
+  std::ofstream out(file.output.c_str(), std::ios::out | std::ios::binary);
+  if (! out) {
+    file.error = "cannot create " + file.output;
+  } else {
+    {
+      arabic::stream_sink_t sink(out);
+      file.unknown = convert_all(ctx, static_cast<const char *>(data),
+                                 file.bytes, sink, job.mode, job.parse,
+                                 job.step);
+    }
+    file.written = out.tellp();
+    out.close();
+    if (! out)
+      file.error = "cannot write " + file.output;
+  }
+
+  if (data)
+    munmap(data, file.bytes);
+}
+
+static void * convert_files(void * arg)
+{
+  batch_job_t&	    job(*static_cast<batch_job_t *>(arg));
+  arabic::context_t ctx;
+
+  for (;;) {
+    std::size_t i = take_work(job.pool, job.next, 1);
+    if (i >= job.files.size())
+      break;
+
+    batch_file_t& file(job.files[i]);
+    if (! file.error.empty())
+      continue;
+
+    double start = seconds_now();
+    convert_file(ctx, job, file);
+    file.seconds = seconds_now() - start;
+  }
+  return NULL;
+}
+
+static double megabytes_per_second(std::size_t bytes, double seconds)
+{
+  return seconds > 0 ? bytes / seconds / 1e6 : 0;
+}
+
+// Convert `count' files into `outdir', print a report of them to
+// stdout, and return the number that could not be converted.
+
+static std::size_t convert_batch(char * paths[], int count,
+                                 const std::string& outdir,
+                                 arabic::mode_t mode,
+                                 arabic::parse_func_t parse,
+                                 arabic::output_step_t step, int threads)
+{
+  batch_job_t job;
+  job.mode  = mode;
+  job.parse = parse;
+  job.step  = step;
+  job.next  = 0;
+
+  // Two inputs of the same name would be written to the same output
+  std::map<std::string, std::string> names;
+
+  for (int i = 0; i < count; i++) {
+    batch_file_t file;
+    file.path	 = paths[i];
+    file.bytes	 = 0;
+    file.written = 0;
+    file.unknown = 0;
+    file.seconds = 0;
+
+    std::string::size_type slash = file.path.rfind('/');
+    std::string name(slash == std::string::npos ?
+                     file.path : file.path.substr(slash + 1));
+    file.output = outdir + "/" + name;
+
+    std::map<std::string, std::string>::iterator seen = names.find(name);
+    if (name.empty())
+      file.error = "not a file name";
+    else if (seen != names.end())
+      file.error = "same name as " + seen->second;
+    else
+      names[name] = file.path;
+
+    job.files.push_back(file);
+  }
+
+  if (threads > count)
+    threads = count;
+
+  double start = seconds_now();
+
+  // This thread converts files too, should no other start
+  start_workers(job.pool, threads - 1, convert_files, &job);
+  convert_files(&job);
+  join_workers(job.pool);
+
+  double elapsed = seconds_now() - start;
+
+  std::size_t failed = 0, bytes = 0, written = 0, unknown = 0;
+
+  std::printf("%12s %12s %9s %9s %8s  %s\n",
+              "bytes", "written", "ms", "MB/s", "unknown", "file");
+  for (std::vector<batch_file_t>::const_iterator i = job.files.begin();
+       i != job.files.end(); i++) {
+    if (! i->error.empty()) {
+      std::printf("%12s %12s %9s %9s %8s  %s: %s\n", "-", "-", "-", "-",
+                  "-", i->path.c_str(), i->error.c_str());
+      failed++;
+      continue;
+    }
+    std::printf("%12lu %12lu %9.2f %9.1f %8lu  %s\n",
+                (unsigned long) i->bytes, (unsigned long) i->written,
+                i->seconds * 1e3,
+                megabytes_per_second(i->bytes, i->seconds),
+                (unsigned long) i->unknown, i->path.c_str());
+    bytes   += i->bytes;
+    written += i->written;
+    unknown += i->unknown;
+  }
+  std::printf("%12lu %12lu %9.2f %9.1f %8lu  total: %lu converted, "
+              "%lu failed, %d threads\n",
+              (unsigned long) bytes, (unsigned long) written,
+              elapsed * 1e3, megabytes_per_second(bytes, elapsed),
+              (unsigned long) unknown,
+              (unsigned long) (job.files.size() - failed),
+              (unsigned long) failed, threads);
+
+  return failed;
+}
+
+// With --tablet, standard input is read as a tablet: an XML document
+// whose <tablet> holds a <head> with the <title>, then a <leader> and
+// <verse>s.  Each of these holds <text>s, whose <orig> is Arabic in
+// <arab> or Persian in <pers>, transliterated in Aasaan, and whose
+// <trans> is English in <eng>.  The tablet is written out as HTML,
+// LaTeX or OPML, each <arab> and <pers> converted in its own mode: to
+// Arabic script in the <orig>, or transliterated where the English
+// quotes it.
+//
+// The input is read a block at a time and cut into the children of
+// <tablet>, which the -j threads convert while more is read.  They are
+// written out in order, and no more than a few per thread are held at
+// once, so the memory needed does not grow with the document.
+
+enum tablet_kind_t {
+  TAG_BLOCK,			// markup between runs of text
+  TAG_INLINE,			// markup within a run
+  TAG_TEXT,			// English, copied through
+  TAG_SCRIPT			// transliteration, converted
+};
+
+// How an element is rendered.  It is rendered by the first entry that
+// names it and whose `within' is NULL or the name of an element
+// enclosing it; an element with no entry is left out, with everything
+// it holds.  Inline markup inside an <arab> or <pers> is part of the
+// text that gets converted, so its strings there are Aasaan.
+
+struct tablet_tag_t {
+  const char *	  name;
+  const char *	  within;
+  tablet_kind_t	  kind;
+  arabic::mode_t  mode;		// for TAG_SCRIPT, the mode
+  arabic::style_t style;	// and the style to render it in
+  const char *	  open;
+  const char *	  close;
+};
+
+struct tablet_format_t {
+  const char *	       name;
+  const char *	       header;
+  const char *	       footer;
+  const char * const * entities; // &amp; &lt; &gt; &quot; &apos;, or
+				 // NULL to copy them as they are
+  const char *	       quote;	 // for a '"', or NULL
+  const tablet_tag_t * tags;	 // ending with a NULL name
+};
+
+#define TAG(kind, name, within, open, close)				\
+  { name, within, kind, arabic::ARABIC, arabic::AASAAN, open, close }
+#define SCRIPT(name, within, mode, style, open, close)			\
+  { name, within, TAG_SCRIPT, arabic::mode, arabic::style, open, close }
+#define END_TAGS \
+  { NULL, NULL, TAG_BLOCK, arabic::ARABIC, arabic::AASAAN, NULL, NULL }
+
+static const tablet_tag_t html_tablet_tags[] = {
+  TAG(TAG_BLOCK,   "head",   NULL,    "", ""),
+  TAG(TAG_BLOCK,   "title",  NULL,    "<h1>", "</h1>\n"),
+  TAG(TAG_BLOCK,   "text",   "title", "", ""),
+  SCRIPT("arab",   "title",  ARABIC,  UTF8,
+	 "<span dir=\"rtl\" lang=\"ar\">", "</span>"),
+  SCRIPT("pers",   "title",  PERSIAN, UTF8,
+	 "<span dir=\"rtl\" lang=\"fa\">", "</span>"),
+  TAG(TAG_TEXT,    "eng",    "title", "<br>\n", ""),
+  TAG(TAG_BLOCK,   "leader", NULL,    "<div class=\"leader\">\n", "</div>\n"),
+  TAG(TAG_BLOCK,   "verse",  NULL,    "<div class=\"verse\">\n", "</div>\n"),
+  TAG(TAG_BLOCK,   "text",   NULL,
+      "<table class=\"text\" width=\"100%\">\n<tr>\n", "</tr>\n</table>\n"),
+  TAG(TAG_BLOCK,   "orig",   NULL,
+      "<td class=\"orig\" dir=\"rtl\" width=\"50%\">", "</td>\n"),
+  TAG(TAG_BLOCK,   "trans",  NULL,
+      "<td class=\"trans\" width=\"50%\">", "</td>\n"),
+  SCRIPT("arab",   "eng",    ARABIC,  HTML_HOUSE, "<i>", "</i>"),
+  SCRIPT("pers",   "eng",    PERSIAN, HTML_HOUSE, "<i>", "</i>"),
+  SCRIPT("arab",   NULL,     ARABIC,  UTF8, "<span lang=\"ar\">", "</span>"),
+  SCRIPT("pers",   NULL,     PERSIAN, UTF8, "<span lang=\"fa\">", "</span>"),
+  TAG(TAG_TEXT,    "eng",    NULL,    "", ""),
+  TAG(TAG_INLINE,  "quote",  "arab",  "``", "''"),
+  TAG(TAG_INLINE,  "quote",  "pers",  "``", "''"),
+  TAG(TAG_INLINE,  "quote",  NULL,    "&ldquo;", "&rdquo;"),
+  TAG(TAG_INLINE,  "emdash", NULL,    "&mdash;", ""),
+  TAG(TAG_BLOCK,   "newpar", NULL,    "<p>", ""),
+  TAG(TAG_BLOCK,   "poem",   NULL,    "<div class=\"poem\">\n", "</div>\n"),
+  TAG(TAG_BLOCK,   "line",   NULL,    "<div class=\"line\">", "</div>\n"),
+  END_TAGS
+};
+
+static const tablet_tag_t latex_tablet_tags[] = {
+  TAG(TAG_BLOCK,   "head",   NULL,    "", ""),
+  TAG(TAG_BLOCK,   "title",  NULL,
+      "\\begin{center}\n\\Large ", "\n\\end{center}\n"),
+  TAG(TAG_BLOCK,   "text",   "title", "", ""),
+  SCRIPT("arab",   "title",  ARABIC,  ARABTEX, "{\\setarab \\<", ">}"),
+  SCRIPT("pers",   "title",  PERSIAN, ARABTEX, "{\\setfarsi \\<", ">}"),
+  TAG(TAG_TEXT,    "eng",    "title", "\\\\\n", ""),
+  TAG(TAG_BLOCK,   "leader", NULL,    "", "\n"),
+  TAG(TAG_BLOCK,   "verse",  NULL,    "", "\n"),
+  TAG(TAG_BLOCK,   "text",   NULL,    "\\vspace{2ex}\n", ""),
+  TAG(TAG_BLOCK,   "orig",   NULL,
+      "\\twoblocks{\n\\begin{RLtext}\n", "\n\\end{RLtext}}"),
+  TAG(TAG_BLOCK,   "trans",  NULL,    "{\n", "\n}\n"),
+  SCRIPT("arab",   "eng",    ARABIC,  LATEX_HOUSE, "", ""),
+  SCRIPT("pers",   "eng",    PERSIAN, LATEX_HOUSE, "", ""),
+  SCRIPT("arab",   NULL,     ARABIC,  ARABTEX,
+	 "\\setarab \\newtanwin \\fullvocalize\n", "\n"),
+  SCRIPT("pers",   NULL,     PERSIAN, ARABTEX,
+	 "\\setfarsi \\newtanwin \\vocalize\n", "\n"),
+  TAG(TAG_TEXT,    "eng",    NULL,    "", ""),
+  TAG(TAG_INLINE,  "quote",  "arab",  "``", "''"),
+  TAG(TAG_INLINE,  "quote",  "pers",  "``", "''"),
+  TAG(TAG_INLINE,  "quote",  NULL,    "``", "''"),
+  TAG(TAG_INLINE,  "emdash", NULL,    "---", ""),
+  TAG(TAG_BLOCK,   "newpar", NULL,    "\n\n", ""),
+  TAG(TAG_BLOCK,   "poem",   NULL,    "", ""),
+  TAG(TAG_BLOCK,   "line",   NULL,    "", " \\\\\n"),
+  END_TAGS
+};
+
+// Each <text> becomes an outline of its original, holding another of
+// its translation
+
+static const tablet_tag_t opml_tablet_tags[] = {
+  TAG(TAG_BLOCK,   "head",   NULL,    "<head>\n", "</head>\n<body>\n"),
+  TAG(TAG_BLOCK,   "title",  NULL,    "<title>", "</title>\n"),
+  TAG(TAG_BLOCK,   "text",   "title", "", ""),
+  SCRIPT("arab",   "title",  ARABIC,  UTF8, "", ""),
+  SCRIPT("pers",   "title",  PERSIAN, UTF8, "", ""),
+  TAG(TAG_TEXT,    "eng",    "title", " / ", ""),
+  TAG(TAG_BLOCK,   "leader", NULL,    "", ""),
+  TAG(TAG_BLOCK,   "verse",  NULL,    "", ""),
+  TAG(TAG_BLOCK,   "text",   NULL,    "<outline text=\"", "</outline>\n"),
+  TAG(TAG_BLOCK,   "orig",   NULL,    "", ""),
+  TAG(TAG_BLOCK,   "trans",  NULL,    "\">\n<outline text=\"", "\"/>\n"),
+  SCRIPT("arab",   "eng",    ARABIC,  HTML_HOUSE, "", ""),
+  SCRIPT("pers",   "eng",    PERSIAN, HTML_HOUSE, "", ""),
+  SCRIPT("arab",   NULL,     ARABIC,  UTF8, "", ""),
+  SCRIPT("pers",   NULL,     PERSIAN, UTF8, "", ""),
+  TAG(TAG_TEXT,    "eng",    NULL,    "", ""),
+  TAG(TAG_INLINE,  "quote",  "arab",  "``", "''"),
+  TAG(TAG_INLINE,  "quote",  "pers",  "``", "''"),
+  TAG(TAG_INLINE,  "quote",  NULL,    "&#8220;", "&#8221;"),
+  TAG(TAG_INLINE,  "emdash", NULL,    "&#8212;", ""),
+  TAG(TAG_BLOCK,   "poem",   NULL,    "", ""),
+  TAG(TAG_BLOCK,   "line",   NULL,    "", " / "),
+  END_TAGS
+};
+
+#undef TAG
+#undef SCRIPT
+#undef END_TAGS
+
+static const char * const plain_entities[] = {
+  "&", "<", ">", "\"", "'"
+};
+static const char * const latex_entities[] = {
+  "\\&", "$<$", "$>$", "\"", "'"
+};
+
+static const tablet_format_t tablet_formats[] = {
+  { "html",
+    "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01//EN\">\n"
+    "<html>\n<head>\n"
+    "<meta http-equiv=\"Content-Type\" content=\"text/html; charset=utf-8\">\n"
+    "</head>\n<body>\n",
+    "</body>\n</html>\n",
+    NULL, NULL, html_tablet_tags },
+  { "latex",
+    "\\documentclass[12pt]{article}\n"
+    "\\usepackage{arabtex}\n"
+    "\\usepackage{twoblks}\n"
+    "\\usepackage[margin=1in,nohead,nofoot]{geometry}\n\n"
+    "\\pagestyle{plain}\n"
+    "\\setlength{\\parskip}{1\\baselineskip}\n\n"
+    "\\begin{document}\n",
+    "\\end{document}\n",
+    latex_entities, NULL, latex_tablet_tags },
+  { "opml",
+    "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<opml version=\"1.0\">\n",
+    "</body>\n</opml>\n",
+    NULL, "&quot;", opml_tablet_tags },
+  { NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+// A piece of XML markup: a tag if `name_len' is not 0, otherwise a
+// comment, a declaration or a processing instruction
+
+struct xml_markup_t {
+  std::size_t name;		// where the element's name begins
+  std::size_t name_len;
+  std::size_t end;		// just past the final '>'
+  bool	      closing;		// </name>
+  bool	      empty;		// <name/>
+};
+
+// Scan the markup whose '<' is at in[pos].  Returns false if it does
+// not end before `len'.
+
+static bool scan_markup(const char * in, std::size_t len, std::size_t pos,
+                        xml_markup_t& markup)
+{
+  const char * p   = in + pos + 1;
+  const char * end = in + len;
+
+  markup.name	 = 0;
+  markup.name_len = 0;
+  markup.closing  = false;
+  markup.empty	 = false;
+
+  if (end - p >= 3 && std::memcmp(p, "!--", 3) == 0) {
+    const char * stop = "-->";
+    p = std::search(p + 3, end, stop, stop + 3);
+    if (p == end)
+      return false;
+    markup.end = p + 3 - in;
+    return true;
+  }
+  if (p == end)
+    return false;
+
+  bool tag = *p != '!' && *p != '?';
+  if (tag) {
+    if (*p == '/') {
+      markup.closing = true;
+      p++;
+    }
+    const char * name = p;
+    while (p < end && ! isspace((unsigned char) *p) && *p != '/' &&
+           *p != '>')
+      p++;
+    markup.name	   = name - in;
+    markup.name_len = p - name;
+  }
+
+  // A '>' may appear inside a quoted attribute value
+  char quote = '\0';
+  for (; p < end; p++) {
+    if (quote) {
+      if (*p == quote)
+        quote = '\0';
+    }
+    else if (*p == '"' || *p == '\'')
+      quote = *p;
+    else if (*p == '>')
+      break;
+  }
+  if (p == end)
+    return false;
+
+  markup.empty = tag && ! markup.closing && p[-1] == '/';
+  markup.end   = p + 1 - in;
+  return true;
+}
+
+static bool is_named(const char * name, std::size_t len, const char * as)
+{
+  return std::strlen(as) == len && std::memcmp(name, as, len) == 0;
+}
+
+// Renders one child of <tablet> as an element at a time is opened or
+// closed around runs of its text.  Runs of whitespace are written as
+// a single space, and only between other text; the text of an <arab>
+// or <pers> is gathered as it comes, and converted as a whole when the
+// element or some block markup within it ends.
+
+struct tablet_renderer_t {
+  tablet_renderer_t(arabic::context_t& _ctx, const tablet_format_t& _format,
+                    std::string& _out)
+    : ctx(_ctx), format(_format), out(_out), script(NULL), skipped(0),
+      texts(0), started(false), pending(false) { }
+
+  void open(const char * name, std::size_t len);
+  void close();
+  void text(const char * in, std::size_t len);
+
+private:
+  struct node_t {
+    const char *	 name;
+    std::size_t		 len;
+    const tablet_tag_t * tag;	// NULL if it is left out
+  };
+
+  arabic::context_t&	 ctx;
+  const tablet_format_t& format;
+  std::string&		 out;
+  std::vector<node_t> elements; // those open, outermost first
+  const tablet_tag_t *	 script;   // the innermost <arab> or <pers>
+  std::string		 source;   // its text not yet converted
+  std::size_t		 skipped;  // open elements being left out
+  std::size_t		 texts;	   // open elements of text
+  bool			 started;  // the current run has text
+  bool			 pending;  // a space is owed before more
+
+  std::string& target() {
+    return script ? source : out;
+  }
+
+  const tablet_tag_t * find_tag(const char * name, std::size_t len) const;
+  void flush();
+};
+
+const tablet_tag_t *
+tablet_renderer_t::find_tag(const char * name, std::size_t len) const
+{
+  for (const tablet_tag_t * tag = format.tags; tag->name; tag++) {
+    if (! is_named(name, len, tag->name))
+      continue;
+    if (! tag->within)
+      return tag;
+    for (std::vector<node_t>::const_iterator i = elements.begin();
+         i != elements.end(); i++)
+      if (is_named(i->name, i->len, tag->within))
+        return tag;
+  }
+  return NULL;
+}
+
+void tablet_renderer_t::flush()
+{
+  if (! script || source.empty())
+    return;
+
+  std::size_t start = out.length();
+
+  ctx.parse_modes.clear();
+  ctx.tokens.clear();
+  arabic::parse_aasaan(ctx, source.data(), source.length(), ctx.tokens,
+                       script->mode, false);
+  {
+    arabic::string_sink_t sink(out);
+    (*arabic::find_renderer(script->style))(ctx, ctx.tokens, sink,
+                                            script->mode);
+  }
+  source.clear();
+
+  // What could not be converted is copied through, and may need escaping
+  if (format.quote)
+    for (std::size_t i = out.find('"', start); i != std::string::npos;
+         i = out.find('"', i + 1))
+      out.replace(i, 1, format.quote);
+}
+
+void tablet_renderer_t::open(const char * name, std::size_t len)
+{
+  node_t node;
+  node.name = name;
+  node.len  = len;
+  node.tag  = skipped ? NULL : find_tag(name, len);
+  elements.push_back(node);
+
+  const tablet_tag_t * tag = node.tag;
+  if (! tag) {
+    skipped++;
+    return;
+  }
+
+  switch (tag->kind) {
+  case TAG_SCRIPT:
+    flush();
+    if (pending)
+      out += ' ';
+    out	  += tag->open;
+    script = tag;
+    texts++;
+    started = pending = false;
+    break;
+
+  case TAG_INLINE:
+    if (pending)
+      target() += ' ';
+    target() += tag->open;
+    started = true;
+    pending = false;
+    break;
+
+  case TAG_TEXT:
+    texts++;
+    // fall through
+  case TAG_BLOCK:
+    flush();
+    out += tag->open;
+    started = pending = false;
+    break;
+  }
+}
+
+void tablet_renderer_t::close()
+{
+  if (elements.empty())
+    return;
+
+  const tablet_tag_t * tag = elements.back().tag;
+  elements.pop_back();
+  if (! tag) {
+    skipped--;
+    return;
+  }
+
+  switch (tag->kind) {
+  case TAG_SCRIPT:
+    flush();
+    out += tag->close;
+    texts--;
+    script = NULL;
+    for (std::vector<node_t>::const_reverse_iterator i = elements.rbegin();
+         i != elements.rend() && ! script; i++)
+      if (i->tag && i->tag->kind == TAG_SCRIPT)
+        script = i->tag;
+    started = true;
+    pending = false;
+    break;
+
+  case TAG_INLINE:
+    target() += tag->close;
+    started = true;
+    break;
+
+  case TAG_TEXT:
+    texts--;
+    // fall through
+  case TAG_BLOCK:
+    flush();
+    out += tag->close;
+    started = pending = false;
+    break;
+  }
+}
+
+void tablet_renderer_t::text(const char * in, std::size_t len)
+{
+  static const char * const names[] = {
+    "amp;", "lt;", "gt;", "quot;", "apos;"
+  };
+
+  if (skipped || ! texts)
+    return;
+
+  std::string& to(target());
+  for (std::size_t i = 0; i < len; i++) {
+    char c = in[i];
+    if (isspace((unsigned char) c)) {
+      pending = started;
+      continue;
+    }
+    if (pending)
+      to += ' ';
+    started = true;
+    pending = false;
+
+    if (c == '&') {
+      const char * const * with = script ? plain_entities : format.entities;
+      std::size_t	   which  = 0;
+      for (; with && which < 5; which++) {
+        std::size_t n = std::strlen(names[which]);
+        if (n < len - i && std::memcmp(in + i + 1, names[which], n) == 0)
+          break;
+      }
+      if (with && which < 5) {
+        to += with[which];
+        i  += std::strlen(names[which]);
+        continue;
+      }
+    }
+    else if (c == '"' && ! script && format.quote) {
+      to += format.quote;
+      continue;
+    }
+    to += c;
+  }
+}
+
+static void convert_tablet_part(arabic::context_t& ctx,
+                                const tablet_format_t& format,
+                                const std::string& in, std::string& out)
+{
+  tablet_renderer_t renderer(ctx, format, out);
+
+  for (std::size_t pos = 0; pos < in.length(); ) {
+    if (in[pos] != '<') {
+      std::size_t next = in.find('<', pos);
+      if (next == std::string::npos)
+        next = in.length();
+      renderer.text(in.data() + pos, next - pos);
+      pos = next;
+      continue;
+    }
+
+    xml_markup_t markup;
+    if (! scan_markup(in.data(), in.length(), pos, markup))
+      break;			// cannot happen; the part is whole
+    if (markup.name_len > 0) {
+      if (markup.closing) {
+        renderer.close();
+      } else {
+        renderer.open(in.data() + markup.name, markup.name_len);
+        if (markup.empty)
+          renderer.close();
+      }
+    }
+    pos = markup.end;
+  }
+}
+
+struct tablet_part_t {
+  std::string xml;
+  std::string output;
+  bool	      done;
+};
+
+struct tablet_job_t {
+  const tablet_format_t *   format;
+  std::deque<tablet_part_t> parts;   // read, but not yet written
+  std::size_t		    first;   // the index of parts.front()
+  std::size_t		    next;    // the next part to be taken
+  std::size_t		    ahead;   // how many parts to hold at most
+  bool			    finished; // the input is all read
+  worker_pool_t		    pool;
+};
+
+// The parts are only added and removed by the reading thread, and a
+// deque leaves the others where they are meanwhile, so a worker may
+// convert one without holding the lock.
+
+static void * convert_tablet_parts(void * arg)
+{
+  tablet_job_t&	    job(*static_cast<tablet_job_t *>(arg));
+  arabic::context_t ctx;
+
+  pthread_mutex_lock(&job.pool.lock);
+  for (;;) {
+    while (job.next == job.first + job.parts.size() && ! job.finished)
+      pthread_cond_wait(&job.pool.changed, &job.pool.lock);
+    if (job.next == job.first + job.parts.size())
+      break;
+
+    tablet_part_t& part(job.parts[job.next++ - job.first]);
+    if (part.done)
+      continue;
+    pthread_mutex_unlock(&job.pool.lock);
+
+    convert_tablet_part(ctx, *job.format, part.xml, part.output);
+    std::string().swap(part.xml);
+
+    pthread_mutex_lock(&job.pool.lock);
+    part.done = true;
+    pthread_cond_broadcast(&job.pool.changed);
+  }
+  pthread_mutex_unlock(&job.pool.lock);
+  return NULL;
+}
+
+// Write out the oldest part, once it is converted, and return how
+// many are left.
+
+static std::size_t write_tablet_part(tablet_job_t& job, std::ostream& out)
+{
+  pthread_mutex_lock(&job.pool.lock);
+  tablet_part_t& part(job.parts.front());
+  while (! part.done)
+    pthread_cond_wait(&job.pool.changed, &job.pool.lock);
+  pthread_mutex_unlock(&job.pool.lock);
+
+  out.write(part.output.data(), part.output.length());
+
+  pthread_mutex_lock(&job.pool.lock);
+  job.parts.pop_front();
+  job.first++;
+  std::size_t held = job.parts.size();
+  pthread_mutex_unlock(&job.pool.lock);
+  return held;
+}
+
+// Add a part to be written: XML to convert, or else output as it is.
+// Once the job holds as many parts as it may, the oldest are waited on
+// and written out to make room.
+
+static void add_tablet_part(tablet_job_t& job, const char * data,
+                            std::size_t len, bool xml, std::ostream& out)
+{
+  pthread_mutex_lock(&job.pool.lock);
+  job.parts.push_back(tablet_part_t());
+  tablet_part_t& part(job.parts.back());
+  (xml ? part.xml : part.output).assign(data, len);
+  part.done = ! xml;
+  pthread_cond_broadcast(&job.pool.changed);
+  std::size_t held = job.parts.size();
+  pthread_mutex_unlock(&job.pool.lock);
+
+  while (held >= job.ahead)
+    held = write_tablet_part(job, out);
+}
+
+// Convert the tablet read from `in' to `out' in `format'.  Returns
+// false, after reporting why, if `in' is not a tablet.
+
+static bool convert_tablet(std::istream& in, std::ostream& out,
+                           const tablet_format_t& format, int threads)
+{
+  tablet_job_t job;
+  job.format   = &format;
+  job.first    = 0;
+  job.next     = 0;
+  job.finished = false;
+
+  // With one thread, or none started, the parts are converted as
+  // they are read, and nothing is held back
+  start_workers(job.pool, threads > 1 ? threads : 0, convert_tablet_parts,
+                &job);
+  job.ahead = job.pool.workers.empty() ? 1 : threads * 4;
+
+  arabic::context_t ctx;
+  std::string	    window;	// the input not yet dealt with
+  std::string	    output;
+  std::size_t	    pos	  = 0;	// how far it has been scanned
+  std::size_t	    part  = 0;	// where the open child of <tablet> began
+  int		    depth = 0;	// elements open, counting <tablet>
+  bool		    seen  = false;
+  const char *	    error = NULL;
+  char		    block[65536];
+
+  while (! error) {
+    while (pos < window.length()) {
+      if (window[pos] != '<') {
+        pos = window.find('<', pos);
+        if (pos == std::string::npos)
+          pos = window.length();
+        continue;
+      }
+
+      xml_markup_t markup;
+      if (! scan_markup(window.data(), window.length(), pos, markup))
+        break;			// it ends in the next block
+      std::size_t start = pos;
+      pos = markup.end;
+      if (markup.name_len == 0)
+        continue;
+
+      if (depth == 0) {
+        if (seen || markup.closing ||
+            ! is_named(window.data() + markup.name, markup.name_len,
+                       "tablet")) {
+          error = "not a tablet document";
+          break;
+        }
+        seen = true;
+        add_tablet_part(job, format.header, std::strlen(format.header),
+                        false, out);
+        if (markup.empty)
+          add_tablet_part(job, format.footer, std::strlen(format.footer),
+                          false, out);
+        else
+          depth = 1;
+        continue;
+      }
+      else if (markup.closing) {
+        if (--depth == 0) {
+          add_tablet_part(job, format.footer, std::strlen(format.footer),
+                          false, out);
+          continue;
+        }
+      }
+      else {
+        if (depth == 1)
+          part = start;
+        if (! markup.empty)
+          depth++;
+      }
+      if (depth > 1)
+        continue;
+
+      // A child of <tablet> has ended
+      if (job.pool.workers.empty()) {
+        output.clear();
+        convert_tablet_part(ctx, format, window.substr(part, pos - part),
+                            output);
+        out.write(output.data(), output.length());
+      } else {
+        add_tablet_part(job, window.data() + part, pos - part, true, out);
+      }
+    }
+    if (error)
+      break;
+
+    // Keep only the child of <tablet> being read, if any, and whatever
+    // markup was cut off at the end of the last block
+    std::size_t done = depth > 1 ? part : pos;
+    window.erase(0, done);
+    pos -= done;
+    part = 0;
+
+    in.read(block, sizeof block);
+    if (in.gcount() == 0)
+      break;
+    window.append(block, in.gcount());
+  }
+
+  if (! error && (! seen || depth > 0))
+    error = "the tablet document ends too soon";
+
+  pthread_mutex_lock(&job.pool.lock);
+  job.finished = true;
+  pthread_cond_broadcast(&job.pool.changed);
+  std::size_t held = job.parts.size();
+  pthread_mutex_unlock(&job.pool.lock);
+
+  while (held > 0)
+    held = write_tablet_part(job, out);
+
+  join_workers(job.pool);
+
+  if (error)
+    std::cerr << "arabic: " << error << std::endl;
+  return ! error;
+}
+
+// The names --spans groups give styles by in --from and --to
+
+struct style_name_t {
+  const char *	  name;
+  arabic::style_t style;
+};
+
+static const style_name_t style_names[] = {
+  { "aasaan",	   arabic::AASAAN },
+  { "talattof",	   arabic::TALATTOF },
+  { "unicode",	   arabic::UNICODE },
+  { "utf8",	   arabic::UTF8 },
+  { "latex",	   arabic::ARABTEX },
+  { "latex-house", arabic::LATEX_HOUSE },
+  { "html-house",  arabic::HTML_HOUSE },
+  { NULL,	   arabic::AASAAN }
+};
+
+static const style_name_t * find_style_name(const char * name)
+{
+  const style_name_t * style = style_names;
+  while (style->name && std::strcmp(style->name, name) != 0)
+    style++;
+  return style->name ? style : NULL;
+}
+
 int main(int argc, char *argv[])
 {
   int argi = 1;
   if (argc == argi) {
-    std::cerr << "usage: arabic [--arabic|--persian] --html|--latex|--house "
-              << std::endl;
+    std::cerr << "usage: arabic [-j N] "
+              << "[--talattof|--from-utf8] [--arabic|--persian] "
+              << "--unicode|--utf8|--latex|--latex-house [-o DIR FILE...]"
+              << std::endl
+              << "       arabic [--talattof|--from-utf8] [--arabic|--persian] "
+              << "[--unicode|--utf8|--latex|--latex-house]" << std::endl
+              << "              --spans OPEN CLOSE [--from STYLE] "
+              << "[--to STYLE] [--arabic|--persian]" << std::endl
+              << "              [--spans ...]" << std::endl
+              << "       arabic [-j N] --tablet html|latex|opml" << std::endl;
     return 1;
   }
 
-  arabic::mode_t mode = arabic::ARABIC;
+  int threads = 1;
 
   std::string option = argv[argi];
+  if (option == "-j" && argi + 1 < argc) {
+    threads = std::atoi(argv[argi + 1]);
+    argi += 2;
+  }
+  else if (option.compare(0, 2, "-j") == 0) {
+    threads = std::atoi(option.c_str() + 2);
+    argi++;
+  }
+  if (threads < 1) {
+    std::cerr << "arabic: -j needs a number of threads" << std::endl;
+    return 1;
+  }
+
+  // Convert a tablet document, with each part in the mode it gives
+  option = argi < argc ? argv[argi] : "";
+  if (option == "--tablet") {
+    const tablet_format_t * format = tablet_formats;
+    while (format->name && (argi + 1 >= argc ||
+                            std::strcmp(format->name, argv[argi + 1]) != 0))
+      format++;
+    if (! format->name) {
+      std::cerr << "arabic: --tablet needs html, latex or opml" << std::endl;
+      return 1;
+    }
+    if (argi + 2 < argc) {
+      std::cerr << "arabic: --tablet converts standard input only"
+                << std::endl;
+      return 1;
+    }
+    return convert_tablet(std::cin, std::cout, *format, threads) ? 0 : 1;
+  }
+
+  arabic::parse_func_t parse	 = arabic::parse_aasaan;
+  arabic::style_t      from	 = arabic::AASAAN;
+  bool		       aasaan = true;
+
+  option = argi < argc ? argv[argi] : "";
+  if (option == "--talattof") {
+    parse  = arabic::parse_talattof;
+    from   = arabic::TALATTOF;
+    aasaan = false;
+    argi++;
+  }
+  else if (option == "--from-utf8") {
+    parse  = arabic::parse_unicode;
+    from   = arabic::UTF8;
+    aasaan = false;
+    argi++;
+  }
+
+  arabic::mode_t mode = arabic::ARABIC;
+
+  option = argi < argc ? argv[argi] : "";
   if (option == "--arabic") {
     mode = arabic::ARABIC;
     argi++;
@@ -2920,24 +5319,143 @@ int main(int argc, char *argv[])
     argi++;
   }
 
-  arabic::output_func_t renderer;
-  option = argv[argi];
+  arabic::output_step_t renderer = NULL;
+  arabic::style_t	to	 = arabic::UNICODE;
+  option = argi < argc ? argv[argi] : "";
   if (option == "--unicode") {
-    renderer = arabic::output_unicode;
+    renderer = arabic::output_unicode_step;
+    to	     = arabic::UNICODE;
+    argi++;
+  }
+  else if (option == "--utf8") {
+    renderer = arabic::output_utf8_step;
+    to	     = arabic::UTF8;
     argi++;
   }
   else if (option == "--latex") {
-    renderer = arabic::output_arabtex;
+    renderer = arabic::output_arabtex_step;
+    to	     = arabic::ARABTEX;
     argi++;
   }
   else if (option == "--latex-house") {
-    renderer = arabic::output_latex_house;
+    renderer = arabic::output_latex_house_step;
+    to	     = arabic::LATEX_HOUSE;
     argi++;
   }
-    
-  std::list<arabic::element_t> tokens;
-  arabic::parse_aasaan(std::cin, tokens, mode);
-  (*renderer)(tokens, std::cout, mode);
+  else if (option != "--spans") {
+    std::cerr << "arabic: unknown output style '" << option << "'"
+              << std::endl;
+    return 1;
+  }
+
+  // Convert only the spans between each OPEN and CLOSE, copying the
+  // rest.  A group takes the styles and mode it does not give from the
+  // options before the first.
+  std::vector<arabic::markup_t> spans;
+
+  option = argi < argc ? argv[argi] : "";
+  while (option == "--spans") {
+    if (argi + 2 >= argc || ! *argv[argi + 1] || ! *argv[argi + 2]) {
+      std::cerr << "arabic: --spans needs an opening and a closing delimiter"
+                << std::endl;
+      return 1;
+    }
+
+    arabic::markup_t span = { argv[argi + 1], argv[argi + 2], from, to, mode,
+                              NULL, NULL };
+    bool	     has_to = renderer != NULL;
+    argi += 3;
+
+    for (option = argi < argc ? argv[argi] : "";
+         option == "--from" || option == "--to" ||
+         option == "--arabic" || option == "--persian";
+         option = argi < argc ? argv[argi] : "") {
+      if (option == "--arabic" || option == "--persian") {
+        span.mode = option == "--arabic" ? arabic::ARABIC : arabic::PERSIAN;
+        argi++;
+        continue;
+      }
+
+      bool		   input = option == "--from";
+      const style_name_t * name	 =
+        argi + 1 < argc ? find_style_name(argv[argi + 1]) : NULL;
+      if (input && (! name || ! arabic::find_parser(name->style))) {
+        std::cerr << "arabic: --from needs aasaan, talattof or utf8"
+                  << std::endl;
+        return 1;
+      }
+      if (! input && (! name || ! arabic::find_renderer(name->style))) {
+        std::cerr << "arabic: --to needs unicode, utf8, latex, "
+                  << "latex-house, html-house or aasaan" << std::endl;
+        return 1;
+      }
+      if (input) {
+        span.from = name->style;
+      } else {
+        span.to = name->style;
+        has_to	= true;
+      }
+      argi += 2;
+    }
+
+    if (! has_to) {
+      std::cerr << "arabic: --spans " << span.open << ' ' << span.close
+                << " needs --to or an output style"
+                << std::endl;
+      return 1;
+    }
+    spans.push_back(span);
+  }
+
+  option = argi < argc ? argv[argi] : "";
+  if (option == "-o" && ! spans.empty()) {
+    std::cerr << "arabic: --spans converts standard input only" << std::endl;
+    return 1;
+  }
+  else if (option == "-o") {
+    struct stat dir;
+    if (argi + 2 >= argc) {
+      std::cerr << "arabic: -o needs a directory and files to convert"
+                << std::endl;
+      return 1;
+    }
+    if (stat(argv[argi + 1], &dir) != 0 || ! S_ISDIR(dir.st_mode)) {
+      std::cerr << "arabic: '" << argv[argi + 1] << "' is not a directory"
+                << std::endl;
+      return 1;
+    }
+    return convert_batch(argv + argi + 2, argc - argi - 2, argv[argi + 1],
+                         mode, parse, renderer, threads) ? 1 : 0;
+  }
+  else if (argi < argc) {
+    std::cerr << "arabic: files to convert need -o DIR" << std::endl;
+    return 1;
+  }
+
+  arabic::context_t ctx;
+  if (! spans.empty()) {
+    ctx.buffer.assign(std::istreambuf_iterator<char>(std::cin),
+                      std::istreambuf_iterator<char>());
+    arabic::stream_sink_t sink(std::cout);
+    arabic::expand_markup(ctx, ctx.buffer.data(), ctx.buffer.length(),
+                          &spans[0], spans.size(), sink);
+  }
+  else if (! aasaan) {
+    ctx.buffer.assign(std::istreambuf_iterator<char>(std::cin),
+                      std::istreambuf_iterator<char>());
+    std::string in;
+    in.swap(ctx.buffer);	// convert_all resets the context
+    arabic::stream_sink_t sink(std::cout);
+    convert_all(ctx, in.data(), in.length(), sink, mode, parse, renderer);
+  }
+  else if (threads > 1) {
+    ctx.buffer.assign(std::istreambuf_iterator<char>(std::cin),
+                      std::istreambuf_iterator<char>());
+    convert_parallel(ctx.buffer.data(), ctx.buffer.length(), std::cout,
+                     mode, renderer, threads);
+  } else {
+    arabic::convert_fused(ctx, std::cin, std::cout, mode, renderer);
+  }
 
   return 0;
 }
@@ -1,6 +1,13 @@
 #ifndef _ARABIC_H
 #define _ARABIC_H
 
+#include <stddef.h>
+
+#ifdef __cplusplus
+
+#include <string>
+#include <vector>
+
 namespace arabic {
 
 enum token_t {
@@ -83,6 +90,16 @@ enum token_t {
 
 enum mode_t { ARABIC, PERSIAN };
 
+enum style_t {
+  AASAAN,
+  ARABTEX,
+  UNICODE,
+  LATEX_HOUSE,
+  HTML_HOUSE,
+  TALATTOF,
+  UTF8
+};
+
 #define TF_NO_FLAGS 	  0x00000000
 
 #define TF_CONSONANT 	  0x00000001
@@ -107,15 +124,23 @@ enum mode_t { ARABIC, PERSIAN };
 #define TF_CAPITALIZE 	  0x00020000
 #define TF_BAA_KULAA 	  0x00040000
 
+#define TF_ALL_FLAGS	  0x00ffffff
+
+// An element is packed into a single 32-bit word: eight bits of token
+// and twenty-four bits of flags.  Both fit with room to spare, and it
+// keeps the token stream of a large text at a quarter of the size it
+// would be with a full enum and an unsigned long side by side.  Use
+// token_of() and flags_of() when the wide form is needed.
+
 struct element_t {
-  token_t 	token;
-  unsigned long flags;
+  token_t      token : 8;
+  unsigned int flags : 24;
 
   element_t() : token(NONE), flags(TF_NO_FLAGS) { }
   element_t(const element_t& other)
     : token(other.token), flags(other.flags) { }
   element_t(token_t tok, unsigned long fl = TF_NO_FLAGS)
-    : token(tok), flags(fl) { }
+    : token(tok), flags(fl & TF_ALL_FLAGS) { }
 
   element_t& operator=(const element_t& other) {
     token = other.token;
@@ -123,14 +148,181 @@ struct element_t {
     return *this;
   }
 
-  bool operator==(const element_t& other) {
+  token_t token_of() const {
+    return token;
+  }
+  unsigned long flags_of() const {
+    return flags;
+  }
+
+  void set_token(token_t tok) {
+    token = tok;
+  }
+  void set_flags(unsigned long fl) {
+    flags = fl & TF_ALL_FLAGS;
+  }
+
+  bool operator==(const element_t& other) const {
     return token == other.token && flags == other.flags;
   }
-  bool operator!=(const element_t& other) {
+  bool operator!=(const element_t& other) const {
     return ! (*this == other);
   }
 };
 
+// Tokens are kept in a contiguous buffer.  Parsers may back-patch
+// the flags of the last few elements, or pop elements they pushed
+// speculatively, so code holding on to an element across a push must
+// do so by index rather than by reference.
+
+typedef std::vector<element_t> elements_t;
+
+// A conversion context holds everything a parse or render needs to
+// remember besides its arguments: the modes saved by nested A/ and P/
+// sections, scratch buffers that convert() reuses from one call to the
+// next, and an optional cache of parsed words.  Nothing else in the
+// library is mutable, so any number of threads may convert at once
+// provided each has a context of its own.
+
+// What a renderer carries from one token to the next.  Each output_*
+// function resets it before rendering a whole buffer; the fused
+// convert() keeps it across the window as it slides over the input.
+// A token of NONE in `last' or `last_letter' means there was none.
+
+struct render_state_t {
+  mode_t	      mode;
+  element_t	      last;	   // the previous token rendered
+  element_t	      last_letter; // the most recent letter rendered
+  std::vector<mode_t> modes;	   // modes to restore at /A or /P
+
+  render_state_t() : mode(ARABIC) { }
+
+  void reset(mode_t initial) {
+    mode	= initial;
+    last	= element_t();
+    last_letter = element_t();
+    modes.clear();
+  }
+
+  bool operator==(const render_state_t& other) const {
+    return (mode == other.mode && last == other.last &&
+	    last_letter == other.last_letter && modes == other.modes);
+  }
+  bool operator!=(const render_state_t& other) const {
+    return ! (*this == other);
+  }
+};
+
+// A bounded memo of the tokens single words parse into, keyed on the
+// word's bytes, the mode and the token before it.  It is empty and
+// unused until given a capacity; once it holds that many words it is
+// emptied and starts over.  Only words whose parse depends on nothing
+// else are entered, so a hit gives exactly what parsing would.
+
+struct word_cache_t {
+  struct stats_t {
+    unsigned long hits;
+    unsigned long misses;
+    std::size_t   entries;
+    std::size_t   bytes;	// memory held, including slack
+  };
+
+  word_cache_t() : capacity(0), entries(0), hits(0), misses(0) { }
+
+  bool enabled() const {
+    return capacity > 0;
+  }
+
+  void	  set_capacity(std::size_t words);
+  void	  clear();
+  stats_t stats() const;
+
+  // Appends the cached tokens for `word' to `out', or returns false
+  bool lookup(const char * word, std::size_t len, mode_t mode,
+	      token_t prev, elements_t& out);
+  void insert(const char * word, std::size_t len, mode_t mode,
+	      token_t prev, elements_t::const_iterator begin,
+	      elements_t::const_iterator end);
+
+private:
+  struct slot_t {
+    unsigned int   hash;	// 0 marks an empty slot
+    unsigned int   key;		// offset of the word in `keys'
+    unsigned int   first;	// offset of its tokens in `values'
+    unsigned char  key_len;
+    unsigned char  count;	// number of tokens
+    unsigned char  mode;
+    unsigned char  prev;
+  };
+
+  std::size_t	      capacity;
+  std::size_t	      entries;
+  unsigned long	      hits;
+  unsigned long	      misses;
+  std::vector<slot_t> slots;
+  std::string	      keys;
+  elements_t	      values;
+};
+
+struct context_t {
+  std::vector<mode_t> parse_modes; // modes to restore at /A or /P
+  render_state_t      render;
+  elements_t	      tokens;
+  std::string	      buffer;
+  word_cache_t	      words;	   // kept across reset()
+
+  void reset() {
+    parse_modes.clear();
+    render.reset(ARABIC);
+    tokens.clear();
+    buffer.clear();
+  }
+};
+
+// Parses Aasaan text that arrives a piece at a time, as from a pipe or
+// a socket, without ever holding all of it.  Each piece passed to
+// feed() is parsed up to the end of its last run of whitespace, where
+// the parse cannot depend on what follows -- unless the run comes
+// after `^' or `~', whose parse looks past it.  The tokens found
+// are appended to `out', save the last two, which the next piece may
+// still revise; the text after the run is held until more arrives.
+// finish() parses whatever is left at the end of the input.
+
+struct aasaan_parser_t {
+  aasaan_parser_t(context_t& _ctx, mode_t _mode = ARABIC)
+    : ctx(_ctx), mode(_mode) { }
+
+  void feed(const char * data, std::size_t len, elements_t& out);
+  void finish(elements_t& out);
+
+  // Bytes of input held back, waiting for more
+  std::size_t pending() const {
+    return held.length();
+  }
+
+private:
+  context_t&  ctx;
+  mode_t      mode;
+  std::string held;
+  elements_t  tokens;		// the last of which are not yet passed on
+
+  void parse(std::size_t len, bool more, elements_t& out);
+};
+
+// A kind of span for expand_markup() to convert: the text between
+// `open' and `close' is parsed as `from' in `mode' and rendered as
+// `to', between `before' and `after' if they are not NULL.
+
+struct markup_t {
+  const char * open;
+  const char * close;
+  style_t      from;
+  style_t      to;
+  mode_t       mode;
+  const char * before;
+  const char * after;
+};
+
 inline bool is_letter(const element_t& elem) {
   return elem.token > FIRST && elem.token < LAST;
 }
@@ -140,6 +332,60 @@ inline bool is_sukun(const element_t& elem) {
 	    (TF_FATHA | TF_KASRA | TF_DHAMMA | TF_DEFECTIVE_ALIF));
 }
 
+// PUSH_MODE and POP_MODE hold the mode to change to in their flags,
+// and take no other marks.  mode_of() reads it back, ignoring any
+// other bits a token built by hand may have set.
+
+inline bool is_mode_change(const element_t& elem) {
+#ifdef MODE_STACK
+  return elem.token == PUSH_MODE || elem.token == POP_MODE;
+#else
+  (void) elem;
+  return false;
+#endif
+}
+
+inline mode_t mode_of(const element_t& elem) {
+  return (elem.flags & PERSIAN) ? PERSIAN : ARABIC;
 }
 
-#endif // _ARABIC_H
+}
+
+extern "C" {
+#endif /* __cplusplus */
+
+/* C interface.  A context is opaque, and must not be used by two
+   threads at once.  `from', `to' and `mode' take the values of
+   arabic::style_t and arabic::mode_t.
+
+   arabic_convert writes at most `capacity' bytes to `out', including
+   a terminating NUL, and returns the length of the complete result
+   (not counting the NUL).  If that is not less than `capacity', the
+   output was truncated and the call may be repeated with a larger
+   buffer.  Once a context has warmed up, a call makes no heap
+   allocations of its own.  It returns (size_t) -1 if `from' is not
+   an input style or `to' not an output style. */
+
+typedef struct arabic_context arabic_context;
+
+arabic_context * arabic_context_new(void);
+void		 arabic_context_free(arabic_context * ctx);
+
+size_t arabic_convert(arabic_context * ctx, const char * in, size_t len,
+		      int from, int to, int mode,
+		      char * out, size_t capacity);
+
+/* Give a context a cache of up to `words' parsed words, or none if
+   `words' is 0, and report how it has fared since.  Any of the
+   pointers passed to arabic_cache_stats may be NULL. */
+
+void arabic_context_cache(arabic_context * ctx, size_t words);
+void arabic_cache_stats(const arabic_context * ctx,
+			unsigned long * hits, unsigned long * misses,
+			size_t * entries, size_t * bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ARABIC_H */
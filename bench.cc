@@ -0,0 +1,180 @@
+// Timings for the parser and its token buffer, to compare one version
+// of arabic.cc with another: build this against each tree and run
+// both on the same input.
+//
+//   g++ -O2 -o bench bench.cc -lpthread	(or make bench)
+//   ./bench [FILE]		FILE is haftvadi.xml by default
+//
+// Every figure is the best of several runs, which is the most stable
+// measure on a busy machine.
+
+#include "arabic.cc"
+
+#include <fstream>
+#include <iomanip>
+#include <list>
+#include <time.h>
+
+using namespace arabic;
+
+static const int bench_runs	  = 10;
+static const int bench_rounds  = 10;
+static const int bench_repeats = 20;
+
+static double bench_now()
+{
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// The best time, in seconds, to parse `text' as Aasaan in `mode'
+
+static double bench_parse(const std::string& text, arabic::mode_t mode)
+{
+  context_t  ctx;
+  elements_t out;
+  double     best = 1e9;
+
+  for (int run = 0; run < bench_runs; run++) {
+    std::size_t	   pos	 = 0;
+    arabic::mode_t inner = mode;
+
+    ctx.reset();
+    out.clear();
+
+    double start = bench_now();
+    parse_aasaan(ctx, text.data(), text.length(), pos, out, inner, false);
+    best = std::min(best, bench_now() - start);
+  }
+  return best;
+}
+
+// The cost of a word-initial vowel, which the parser checks for the
+// second way of writing a sun letter (ar-ra.hman).  The words of
+// `text' that begin with `a' are parsed as they are, and again with
+// that `a' taken off; the difference, over the number of words, is
+// what the vowel costs.  The words are repeated to make the times
+// long enough to measure.
+
+static void bench_initial_vowels(const std::string& text,
+                                 arabic::mode_t mode)
+{
+  std::string with;
+  std::string without;
+  std::size_t words = 0;
+
+  for (std::size_t pos = 0; pos < text.length(); ) {
+    std::size_t end = pos;
+    while (end < text.length() && ! isspace((unsigned char) text[end]))
+      end++;
+
+    if (end - pos > 1 && text[pos] == 'a' && text[pos + 1] != 'a') {
+      with.append(text, pos, end - pos);
+      with += ' ';
+      without.append(text, pos + 1, end - pos - 1);
+      without += ' ';
+      words++;
+    }
+    pos = end + 1;
+  }
+
+  std::string list(with);
+  for (int i = 1; i < bench_repeats; i++)
+    with += list;
+  list = without;
+  for (int i = 1; i < bench_repeats; i++)
+    without += list;
+  words *= bench_repeats;
+
+  // Alternate between the two, so that both see the same load
+  double parse_with    = 1e9;
+  double parse_without = 1e9;
+  for (int round = 0; round < bench_rounds; round++) {
+    parse_with	  = std::min(parse_with, bench_parse(with, mode));
+    parse_without = std::min(parse_without, bench_parse(without, mode));
+  }
+
+  std::cout << "word-initial a:   " << words << " words, "
+            << std::fixed << std::setprecision(1)
+            << (parse_with - parse_without) * 1e9 / words
+            << " ns per vowel ("
+            << std::setprecision(3) << parse_with * 1e3 << " ms with, "
+            << parse_without * 1e3 << " ms without)" << std::endl;
+}
+
+// The token buffer was a std::list before it was an elements_t.  The
+// parsers build it a token at a time, revising the last one or two,
+// and the renderers walk it looking at each token's neighbours.  Both
+// patterns are replayed here, on the tokens `text' parses into, with
+// each kind of sequence.
+
+// Keeps the walks from being optimized away
+static volatile unsigned long bench_sink;
+
+template <typename Seq>
+static double bench_sequence(const elements_t& tokens)
+{
+  double	best = 1e9;
+  unsigned long seen = 0;
+
+  for (int run = 0; run < bench_runs * bench_rounds; run++) {
+    double start = bench_now();
+
+    Seq seq;
+    for (elements_t::const_iterator i = tokens.begin();
+         i != tokens.end(); i++) {
+      seq.push_back(*i);
+      seq.back().flags |= i->flags;
+    }
+
+    for (typename Seq::iterator i = seq.begin(); i != seq.end(); i++) {
+      typename Seq::iterator next = i;
+      if (++next != seq.end())
+        seen += next->token;
+      if (i != seq.begin()) {
+        typename Seq::iterator prev = i;
+        seen += (--prev)->token;
+      }
+    }
+    best = std::min(best, bench_now() - start);
+  }
+
+  bench_sink = seen;
+  return best;
+}
+
+static void bench_sequences(const std::string& text, arabic::mode_t mode)
+{
+  context_t   ctx;
+  elements_t  tokens;
+  std::size_t pos = 0;
+  parse_aasaan(ctx, text.data(), text.length(), pos, tokens, mode, false);
+
+  std::cout << "build and walk:   " << tokens.size() << " tokens, "
+            << std::fixed << std::setprecision(3)
+            << bench_sequence<elements_t>(tokens) * 1e3
+            << " ms as elements_t, "
+            << bench_sequence<std::list<element_t> >(tokens) * 1e3
+            << " ms as std::list" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *	path = argc > 1 ? argv[1] : "haftvadi.xml";
+  std::ifstream in(path);
+  if (! in) {
+    std::cerr << "bench: cannot read " << path << std::endl;
+    return 1;
+  }
+  std::string text((std::istreambuf_iterator<char>(in)),
+                   std::istreambuf_iterator<char>());
+
+  std::cout << "parse, Persian:   " << std::fixed << std::setprecision(3)
+            << bench_parse(text, PERSIAN) * 1e3 << " ms for "
+            << text.length() << " bytes" << std::endl;
+
+  bench_initial_vowels(text, PERSIAN);
+  bench_sequences(text, PERSIAN);
+  return 0;
+}
@@ -79,13 +79,8 @@ else:
     translation = None
 
 def render_house (line):
-    match = re.search ("<<(.+?)>>", line)
-    while match:
-        elements = parse (match.group (1), style.AASAAN, mode.PERSIAN)
-        text = render (elements, style.HTML_HOUSE, mode.PERSIAN)
-        line = (line[: match.start ()] + text + line[match.end () :])
-        match = re.search ("<<(.+?)>>", line)
-    return line
+    return expand (line, [("<<", ">>", style.AASAAN, style.HTML_HOUSE,
+                           mode.PERSIAN)])
 
 orig_data = original    and open(original, "r")
 xlat_data = translation and open(translation, "r")
@@ -112,8 +107,7 @@ for line in orig_data or xlat_data:
             width = 0
 
         line = re.sub ("{[^}]+}", "", line)
-        elements = parse (line, style.AASAAN, default_mode)
-        text = render (elements, style.UNICODE, default_mode)
+        text = convert (line, style.AASAAN, style.UNICODE, default_mode)
         text = re.sub("\\s+$", "", text)
         text = re.sub("^\\s+", "", text)
         print "      <outline text=\"%s\"" % text,